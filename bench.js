@@ -1,78 +1,363 @@
-var async = require("async"),
+var fs = require("fs"),
     nacl = require("./build/Release/nacl");
 
-var count = 2000;
+/*
+ * Usage: node bench.js [--ops=box,sign] [--sizes=16,1024] [--concurrency=1,32]
+ *                      [--modes=sync,async,batch] [--count=2000]
+ *                      [--save=file.json] [--baseline=file.json] [--json]
+ *
+ * sync:  one call at a time on the main thread.
+ * async: keeps `concurrency` calls in flight, issuing one as each finishes.
+ * batch: issues `concurrency` calls in one tick and waits for all of them.
+ */
 
-var bench = function(func) {
-    var start = new Date().getTime();
-    var done = function() {
-        var end = new Date().getTime();
-        var diff = ((end - start) / 1000);
-        console.log("Time: " + diff + " sec");
-        console.log((0|(count / diff)) + "op/s");
+var defaults = {
+    ops: "box,box_open,secretbox,secretbox_open,sign,sign_open",
+    sizes: "16,100,1024,16384,65536",
+    concurrency: "1,2,4,8,16,32,64,128,256,512,1024",
+    modes: "sync,async,batch",
+    count: "2000"
+};
+
+var parse_args = function(argv) {
+    var opts = {};
+    for(var k in defaults) {
+        opts[k] = defaults[k];
     }
-    func(done);
-}
+    argv.forEach(function(arg) {
+        var m = /^--([a-z]+)(?:=(.*))?$/.exec(arg);
+        if(!m) {
+            throw new Error("bad argument: " + arg);
+        }
+        opts[m[1]] = m[2] === undefined ? true : m[2];
+    });
 
-var data = new Buffer(100);
-var nonce = new Buffer(nacl.box_NONCEBYTES);
-var kp_send = nacl.box_keypair(),
-    kp_recv = nacl.box_keypair();
+    var list = function(s) { return String(s).split(",").filter(Boolean); };
+    opts.ops = list(opts.ops);
+    opts.modes = list(opts.modes);
+    opts.sizes = list(opts.sizes).map(Number);
+    opts.concurrency = list(opts.concurrency).map(Number);
+    opts.count = Number(opts.count);
+    return opts;
+};
 
-var box = function(cb) {
-    nacl.box(data, nonce, kp_recv[0], kp_send[1], cb);
-}
+/**
+ * HDR-style histogram of nanosecond values: exact below 2^SUB_BITS,
+ * then 2^SUB_BITS linear buckets per power of two, so every recorded
+ * value is within 1/2^SUB_BITS (about 3%) of its bucket.
+ */
+var SUB_BITS = 5,
+    SUB_COUNT = 1 << SUB_BITS;
 
-var encrypted_public = nacl.box_sync(data, nonce, kp_recv[0], kp_send[1])
-var box_open = function(cb) {
-    nacl.box_open(encrypted_public, nonce, kp_send[0], kp_recv[1], cb);
-}
+var Histogram = function() {
+    this.counts = [];
+    this.total = 0;
+    this.min = Infinity;
+    this.max = 0;
+    this.sum = 0;
+};
 
+Histogram.prototype.bucket = function(v) {
+    if(v < SUB_COUNT) {
+        return v;
+    }
+    var exp = Math.floor(Math.log(v) / Math.LN2) - SUB_BITS;
+    var sub = Math.floor(v / Math.pow(2, exp));
+    // Math.log rounding near exact powers of two
+    if(sub >= 2 * SUB_COUNT) {
+        sub = Math.floor(v / Math.pow(2, ++exp));
+    } else if(sub < SUB_COUNT) {
+        sub = Math.floor(v / Math.pow(2, --exp));
+    }
+    return exp * SUB_COUNT + sub;
+};
 
-var kp_sign = nacl.sign_keypair();
-var sign = function(cb) {
-    nacl.sign(data, kp_sign[1], cb);
-}
+// Highest value that lands in bucket b
+Histogram.prototype.value = function(b) {
+    if(b < SUB_COUNT) {
+        return b;
+    }
+    var exp = Math.floor(b / SUB_COUNT) - 1,
+        sub = b - exp * SUB_COUNT;
+    return (sub + 1) * Math.pow(2, exp) - 1;
+};
 
-var sign_boxed = nacl.sign_sync(data, kp_sign[1]);
-var sign_open = function(cb) {
-    nacl.sign_open(sign_boxed, kp_sign[0], cb);
-}
+Histogram.prototype.record = function(v) {
+    v = Math.max(0, Math.round(v));
+    var b = this.bucket(v);
+    this.counts[b] = (this.counts[b] || 0) + 1;
+    this.total++;
+    this.sum += v;
+    if(v < this.min) this.min = v;
+    if(v > this.max) this.max = v;
+};
 
+Histogram.prototype.percentile = function(p) {
+    if(!this.total) {
+        return 0;
+    }
+    var rank = Math.ceil(p / 100 * this.total), seen = 0;
+    for(var b = 0; b < this.counts.length; b++) {
+        seen += this.counts[b] || 0;
+        if(seen >= rank) {
+            return Math.min(this.value(b), this.max);
+        }
+    }
+    return this.max;
+};
 
-var key_secret = new Buffer(nacl.secretbox_KEYBYTES);
-var secretbox = function(cb) {
-    nacl.secretbox(data, nonce, key_secret, cb);
-}
+Histogram.prototype.summary = function() {
+    return {
+        count: this.total,
+        min: this.total ? this.min : 0,
+        mean: this.total ? Math.round(this.sum / this.total) : 0,
+        p50: this.percentile(50),
+        p99: this.percentile(99),
+        p999: this.percentile(99.9),
+        max: this.max
+    };
+};
 
-var encrypted = nacl.secretbox_sync(data, nonce, key_secret);
-var secretbox_open = function(cb) {
-    nacl.secretbox_open(encrypted, nonce, key_secret, cb);
-}
+var elapsed_ns = function(start) {
+    var d = process.hrtime(start);
+    return d[0] * 1e9 + d[1];
+};
 
-var run_bench_with = function(func) {
-    var tasks = [];
+/** Samples event-loop delay: how late a 5ms timer fires. */
+var LAG_INTERVAL_MS = 5;
+
+var LagMonitor = function() {
+    this.hist = new Histogram();
+    this.timer = null;
+};
+
+LagMonitor.prototype.start = function() {
+    var self = this, expected = process.hrtime();
+    var tick = function() {
+        var late = elapsed_ns(expected) - LAG_INTERVAL_MS * 1e6;
+        self.hist.record(late > 0 ? late : 0);
+        expected = process.hrtime();
+        self.timer = setTimeout(tick, LAG_INTERVAL_MS);
+    };
+    this.timer = setTimeout(tick, LAG_INTERVAL_MS);
+};
+
+LagMonitor.prototype.stop = function() {
+    clearTimeout(this.timer);
+    return this.hist.summary();
+};
+
+/** Inputs and sync/async entry points for each operation. */
+var make_ops = function(size) {
+    var data = new Buffer(size),
+        nonce = new Buffer(nacl.box_NONCEBYTES),
+        kp_send = nacl.box_keypair(),
+        kp_recv = nacl.box_keypair(),
+        kp_sign = nacl.sign_keypair(),
+        key_secret = new Buffer(nacl.secretbox_KEYBYTES);
+    data.fill(7);
+    nonce.fill(0);
+    key_secret.fill(1);
+
+    var boxed = nacl.box_sync(data, nonce, kp_recv[0], kp_send[1]),
+        secretboxed = nacl.secretbox_sync(data, nonce, key_secret),
+        signed = nacl.sign_sync(data, kp_sign[1]);
+
+    return {
+        box: {
+            sync: function() { nacl.box_sync(data, nonce, kp_recv[0], kp_send[1]); },
+            async: function(cb) { nacl.box(data, nonce, kp_recv[0], kp_send[1], cb); }
+        },
+        box_open: {
+            sync: function() { nacl.box_open_sync(boxed, nonce, kp_send[0], kp_recv[1]); },
+            async: function(cb) { nacl.box_open(boxed, nonce, kp_send[0], kp_recv[1], cb); }
+        },
+        secretbox: {
+            sync: function() { nacl.secretbox_sync(data, nonce, key_secret); },
+            async: function(cb) { nacl.secretbox(data, nonce, key_secret, cb); }
+        },
+        secretbox_open: {
+            sync: function() { nacl.secretbox_open_sync(secretboxed, nonce, key_secret); },
+            async: function(cb) { nacl.secretbox_open(secretboxed, nonce, key_secret, cb); }
+        },
+        sign: {
+            sync: function() { nacl.sign_sync(data, kp_sign[1]); },
+            async: function(cb) { nacl.sign(data, kp_sign[1], cb); }
+        },
+        sign_open: {
+            sync: function() { nacl.sign_open_sync(signed, kp_sign[0]); },
+            async: function(cb) { nacl.sign_open(signed, kp_sign[0], cb); }
+        }
+    };
+};
+
+var run_sync = function(op, count, hist, done) {
     for(var i = 0; i < count; i++) {
-        tasks.push(func);
+        var t = process.hrtime();
+        op.sync();
+        hist.record(elapsed_ns(t));
     }
+    // let the lag monitor see the blocked loop
+    setImmediate(done);
+};
 
-    return function(cb) {
-        bench(function(done) {
-            async.parallelLimit(tasks, 200, function(err, data) {
-                if(err) {
-                    console.log(err);
-                }
-                done();
-                cb();
+var run_async = function(op, count, concurrency, hist, done) {
+    var issued = 0, finished = 0, failed = null;
+    var issue = function() {
+        var t = process.hrtime();
+        issued++;
+        op.async(function(err) {
+            hist.record(elapsed_ns(t));
+            if(err && !failed) failed = err;
+            if(++finished == count) {
+                return done(failed);
+            }
+            if(issued < count) {
+                issue();
+            }
+        });
+    };
+    for(var i = 0; i < concurrency && i < count; i++) {
+        issue();
+    }
+};
+
+var run_batch = function(op, count, concurrency, hist, done) {
+    var remaining = count, failed = null;
+    var next = function() {
+        var n = Math.min(concurrency, remaining), pending = n;
+        remaining -= n;
+        for(var i = 0; i < n; i++) {
+            (function(t) {
+                op.async(function(err) {
+                    hist.record(elapsed_ns(t));
+                    if(err && !failed) failed = err;
+                    if(--pending) return;
+                    if(remaining) return next();
+                    done(failed);
+                });
+            })(process.hrtime());
+        }
+    };
+    next();
+};
+
+var run_one = function(opts, ops, name, mode, size, concurrency, cb) {
+    var op = ops[name], hist = new Histogram(), lag = new LagMonitor();
+    var start = process.hrtime();
+    var finish = function(err) {
+        var ns = elapsed_ns(start);
+        if(err) {
+            return cb(new Error(name + " " + mode + ": " + err));
+        }
+        var lat = hist.summary();
+        cb(null, {
+            op: name,
+            mode: mode,
+            size: size,
+            concurrency: concurrency,
+            count: opts.count,
+            ops_per_sec: Math.round(opts.count / (ns / 1e9)),
+            bytes_per_sec: Math.round(opts.count * size / (ns / 1e9)),
+            latency_ns: lat,
+            loop_delay_ns: lag.stop()
+        });
+    };
+
+    lag.start();
+    if(mode == "sync") {
+        run_sync(op, opts.count, hist, finish);
+    } else if(mode == "async") {
+        run_async(op, opts.count, concurrency, hist, finish);
+    } else if(mode == "batch") {
+        run_batch(op, opts.count, concurrency, hist, finish);
+    } else {
+        throw new Error("unknown mode: " + mode);
+    }
+};
+
+var key_of = function(r) {
+    return [r.op, r.mode, r.size, r.concurrency].join(" ");
+};
+
+var us = function(ns) {
+    return (ns / 1000).toFixed(1);
+};
+
+var pad = function(s, n) {
+    s = String(s);
+    while(s.length < n) s = " " + s;
+    return s;
+};
+
+var print_header = function() {
+    console.log([pad("op", 14), pad("mode", 5), pad("size", 6), pad("conc", 5),
+        pad("op/s", 9), pad("p50us", 9), pad("p99us", 9), pad("p999us", 9),
+        pad("lag99us", 9), pad("vs base", 8)].join(" "));
+};
+
+var print_result = function(r, base) {
+    var cmp = "";
+    if(base) {
+        cmp = ((r.ops_per_sec / base.ops_per_sec - 1) * 100).toFixed(1) + "%";
+        if(cmp.charAt(0) != "-") cmp = "+" + cmp;
+    }
+    console.log([pad(r.op, 14), pad(r.mode, 5), pad(r.size, 6),
+        pad(r.mode == "sync" ? "-" : r.concurrency, 5), pad(r.ops_per_sec, 9),
+        pad(us(r.latency_ns.p50), 9), pad(us(r.latency_ns.p99), 9),
+        pad(us(r.latency_ns.p999), 9), pad(us(r.loop_delay_ns.p99), 9),
+        pad(cmp, 8)].join(" "));
+};
+
+var main = function() {
+    var opts = parse_args(process.argv.slice(2)), baseline = {}, runs = [];
+
+    if(opts.baseline) {
+        JSON.parse(fs.readFileSync(opts.baseline, "utf8")).results.forEach(function(r) {
+            baseline[key_of(r)] = r;
+        });
+    }
+
+    opts.sizes.forEach(function(size) {
+        var ops = make_ops(size);
+        opts.ops.forEach(function(name) {
+            if(!ops[name]) {
+                throw new Error("unknown op: " + name);
+            }
+            opts.modes.forEach(function(mode) {
+                var conc = mode == "sync" ? [1] : opts.concurrency;
+                conc.forEach(function(c) {
+                    runs.push([ops, name, mode, size, c]);
+                });
             });
         });
+    });
+
+    var results = [];
+    if(!opts.json) print_header();
+    var next = function(i) {
+        if(i == runs.length) {
+            var out = { node: process.version, count: opts.count, results: results };
+            if(opts.save) {
+                fs.writeFileSync(opts.save, JSON.stringify(out, null, 2) + "\n");
+            }
+            if(opts.json) {
+                console.log(JSON.stringify(out, null, 2));
+            }
+            return;
+        }
+        var r = runs[i];
+        run_one(opts, r[0], r[1], r[2], r[3], r[4], function(err, result) {
+            if(err) {
+                console.error(err.message);
+                process.exit(1);
+            }
+            results.push(result);
+            if(!opts.json) print_result(result, baseline[key_of(result)]);
+            setImmediate(function() { next(i + 1); });
+        });
     };
+    next(0);
 };
 
-async.series([
-    run_bench_with(box),
-    run_bench_with(box_open),
-    run_bench_with(sign),
-    run_bench_with(sign_open),
-    run_bench_with(secretbox),
-    run_bench_with(secretbox_open)]);
+main();
@@ -4,6 +4,33 @@ D. J. Bernstein
 Public domain.
 */
 
+/* binding.gyp builds clockmonotonic instead of amd64cpuinfo off x64 */
+#ifdef CPUCYCLES_CLOCKMONOTONIC
+
+#ifndef CPUCYCLES_clockmonotonic_h
+#define CPUCYCLES_clockmonotonic_h
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+extern long long cpucycles_clockmonotonic(void);
+extern long long cpucycles_clockmonotonic_persecond(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#ifndef cpucycles_implementation
+#define cpucycles_implementation "clockmonotonic"
+#define cpucycles cpucycles_clockmonotonic
+#define cpucycles_persecond cpucycles_clockmonotonic_persecond
+#endif
+
+#endif
+
+#else
+
 #ifndef CPUCYCLES_amd64cpuinfo_h
 #define CPUCYCLES_amd64cpuinfo_h
 
@@ -25,3 +52,5 @@ extern long long cpucycles_amd64cpuinfo_persecond(void);
 #endif
 
 #endif
+
+#endif
@@ -5,6 +5,8 @@
 
 #define crypto_secretbox crypto_secretbox_xsalsa20poly1305
 #define crypto_secretbox_open crypto_secretbox_xsalsa20poly1305_open
+#define crypto_secretbox_multi crypto_secretbox_xsalsa20poly1305_multi
+#define crypto_secretbox_open_multi crypto_secretbox_xsalsa20poly1305_open_multi
 #define crypto_secretbox_KEYBYTES crypto_secretbox_xsalsa20poly1305_KEYBYTES
 #define crypto_secretbox_NONCEBYTES crypto_secretbox_xsalsa20poly1305_NONCEBYTES
 #define crypto_secretbox_ZEROBYTES crypto_secretbox_xsalsa20poly1305_ZEROBYTES
@@ -13,12 +13,16 @@ extern "C" {
 #endif
 extern int crypto_secretbox_xsalsa20poly1305_ref(unsigned char *,const unsigned char *,unsigned long long,const unsigned char *,const unsigned char *);
 extern int crypto_secretbox_xsalsa20poly1305_ref_open(unsigned char *,const unsigned char *,unsigned long long,const unsigned char *,const unsigned char *);
+extern int crypto_secretbox_xsalsa20poly1305_ref_multi(unsigned char **,const unsigned char **,const unsigned long long *,const unsigned char **,const unsigned char **,unsigned long long);
+extern int crypto_secretbox_xsalsa20poly1305_ref_open_multi(unsigned char **,const unsigned char **,const unsigned long long *,const unsigned char **,const unsigned char **,int *,unsigned long long);
 #ifdef __cplusplus
 }
 #endif
 
 #define crypto_secretbox_xsalsa20poly1305 crypto_secretbox_xsalsa20poly1305_ref
 #define crypto_secretbox_xsalsa20poly1305_open crypto_secretbox_xsalsa20poly1305_ref_open
+#define crypto_secretbox_xsalsa20poly1305_multi crypto_secretbox_xsalsa20poly1305_ref_multi
+#define crypto_secretbox_xsalsa20poly1305_open_multi crypto_secretbox_xsalsa20poly1305_ref_open_multi
 #define crypto_secretbox_xsalsa20poly1305_KEYBYTES crypto_secretbox_xsalsa20poly1305_ref_KEYBYTES
 #define crypto_secretbox_xsalsa20poly1305_NONCEBYTES crypto_secretbox_xsalsa20poly1305_ref_NONCEBYTES
 #define crypto_secretbox_xsalsa20poly1305_ZEROBYTES crypto_secretbox_xsalsa20poly1305_ref_ZEROBYTES
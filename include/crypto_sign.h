@@ -6,9 +6,15 @@
 #define crypto_sign crypto_sign_edwards25519sha512batch
 #define crypto_sign_open crypto_sign_edwards25519sha512batch_open
 #define crypto_sign_keypair crypto_sign_edwards25519sha512batch_keypair
+#define crypto_sign_expandsk crypto_sign_edwards25519sha512batch_expandsk
+#define crypto_sign_expandpk crypto_sign_edwards25519sha512batch_expandpk
+#define crypto_sign_expanded crypto_sign_edwards25519sha512batch_expanded
+#define crypto_sign_open_expanded crypto_sign_edwards25519sha512batch_open_expanded
 #define crypto_sign_BYTES crypto_sign_edwards25519sha512batch_BYTES
 #define crypto_sign_PUBLICKEYBYTES crypto_sign_edwards25519sha512batch_PUBLICKEYBYTES
 #define crypto_sign_SECRETKEYBYTES crypto_sign_edwards25519sha512batch_SECRETKEYBYTES
+#define crypto_sign_EXPANDEDSECRETKEYBYTES crypto_sign_edwards25519sha512batch_EXPANDEDSECRETKEYBYTES
+#define crypto_sign_EXPANDEDPUBLICKEYBYTES crypto_sign_edwards25519sha512batch_EXPANDEDPUBLICKEYBYTES
 #define crypto_sign_PRIMITIVE "edwards25519sha512batch"
 #define crypto_sign_IMPLEMENTATION crypto_sign_edwards25519sha512batch_IMPLEMENTATION
 #define crypto_sign_VERSION crypto_sign_edwards25519sha512batch_VERSION
@@ -4,6 +4,8 @@
 #define crypto_sign_edwards25519sha512batch_ref_SECRETKEYBYTES 64
 #define crypto_sign_edwards25519sha512batch_ref_PUBLICKEYBYTES 32
 #define crypto_sign_edwards25519sha512batch_ref_BYTES 64
+#define crypto_sign_edwards25519sha512batch_ref_EXPANDEDSECRETKEYBYTES 160
+#define crypto_sign_edwards25519sha512batch_ref_EXPANDEDPUBLICKEYBYTES 512
 #ifdef __cplusplus
 #include <string>
 extern std::string crypto_sign_edwards25519sha512batch_ref(const std::string &,const std::string &);
@@ -14,6 +16,10 @@ extern "C" {
 extern int crypto_sign_edwards25519sha512batch_ref(unsigned char *,unsigned long long *,const unsigned char *,unsigned long long,const unsigned char *);
 extern int crypto_sign_edwards25519sha512batch_ref_open(unsigned char *,unsigned long long *,const unsigned char *,unsigned long long,const unsigned char *);
 extern int crypto_sign_edwards25519sha512batch_ref_keypair(unsigned char *,unsigned char *);
+extern int crypto_sign_edwards25519sha512batch_ref_expandsk(unsigned char *,const unsigned char *);
+extern int crypto_sign_edwards25519sha512batch_ref_expandpk(unsigned char *,const unsigned char *);
+extern int crypto_sign_edwards25519sha512batch_ref_expanded(unsigned char *,unsigned long long *,const unsigned char *,unsigned long long,const unsigned char *);
+extern int crypto_sign_edwards25519sha512batch_ref_open_expanded(unsigned char *,unsigned long long *,const unsigned char *,unsigned long long,const unsigned char *);
 #ifdef __cplusplus
 }
 #endif
@@ -21,9 +27,15 @@ extern int crypto_sign_edwards25519sha512batch_ref_keypair(unsigned char *,unsig
 #define crypto_sign_edwards25519sha512batch crypto_sign_edwards25519sha512batch_ref
 #define crypto_sign_edwards25519sha512batch_open crypto_sign_edwards25519sha512batch_ref_open
 #define crypto_sign_edwards25519sha512batch_keypair crypto_sign_edwards25519sha512batch_ref_keypair
+#define crypto_sign_edwards25519sha512batch_expandsk crypto_sign_edwards25519sha512batch_ref_expandsk
+#define crypto_sign_edwards25519sha512batch_expandpk crypto_sign_edwards25519sha512batch_ref_expandpk
+#define crypto_sign_edwards25519sha512batch_expanded crypto_sign_edwards25519sha512batch_ref_expanded
+#define crypto_sign_edwards25519sha512batch_open_expanded crypto_sign_edwards25519sha512batch_ref_open_expanded
 #define crypto_sign_edwards25519sha512batch_BYTES crypto_sign_edwards25519sha512batch_ref_BYTES
 #define crypto_sign_edwards25519sha512batch_PUBLICKEYBYTES crypto_sign_edwards25519sha512batch_ref_PUBLICKEYBYTES
 #define crypto_sign_edwards25519sha512batch_SECRETKEYBYTES crypto_sign_edwards25519sha512batch_ref_SECRETKEYBYTES
+#define crypto_sign_edwards25519sha512batch_EXPANDEDSECRETKEYBYTES crypto_sign_edwards25519sha512batch_ref_EXPANDEDSECRETKEYBYTES
+#define crypto_sign_edwards25519sha512batch_EXPANDEDPUBLICKEYBYTES crypto_sign_edwards25519sha512batch_ref_EXPANDEDPUBLICKEYBYTES
 #define crypto_sign_edwards25519sha512batch_IMPLEMENTATION "crypto_sign/edwards25519sha512batch/ref"
 #ifndef crypto_sign_edwards25519sha512batch_ref_VERSION
 #define crypto_sign_edwards25519sha512batch_ref_VERSION "-"
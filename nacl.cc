@@ -2,13 +2,21 @@
 #include <uv.h>
 #include <node.h>
 #include <node_buffer.h>
+#include <node_object_wrap.h>
 #include <string.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <limits.h>
+#include <sys/mman.h>
+
+#include <vector>
+#include <deque>
+#include <map>
 
 #include <crypto_box.h>
 #include <crypto_sign.h>
 #include <crypto_secretbox.h>
+#include <cpucycles.h>
 
 
 // Zlib support
@@ -16,8 +24,13 @@
 
 /** In-memory inflate/deflate implementation */
 typedef int (*zlib_op)(mz_streamp strm, int flush);
+typedef int (*zlib_sink)(void *ctx, const char *buf, int buflen);
 #define CHUNK_SIZE (1024 * 16)
 
+// Errors beyond the zlib ones, returned by the loops below
+#define ZLIB_TOO_LARGE (-100)
+#define ZLIB_SINK_ERROR (-101)
+
 static int init_stream(z_stream *strm,
         const void *src, int srclen) {
     strm->total_in = strm->avail_in = srclen;
@@ -28,7 +41,8 @@ static int init_stream(z_stream *strm,
     return !strm->next_out;
 }
 
-static int zlib_loop(z_stream *strm, zlib_op op_func, char **buf, int *buflen) {
+static int zlib_loop(z_stream *strm, zlib_op op_func, int maxlen,
+        char **buf, int *buflen) {
     char *out = (char *)strm->next_out;
     int outlen = strm->avail_out;
 
@@ -39,12 +53,26 @@ static int zlib_loop(z_stream *strm, zlib_op op_func, char **buf, int *buflen) {
         }
 
         if(strm->avail_out == 0) {
-            if(!(out = (char *)realloc(out, outlen << 1)))
+            // Buffer is full, so total_out == outlen here
+            if(maxlen && outlen > maxlen) {
+                err = ZLIB_TOO_LARGE;
                 goto err;
+            }
+
+            int newlen = outlen << 1;
+            if(maxlen && newlen > maxlen)
+                newlen = maxlen + 1;
+
+            char *grown = (char *)realloc(out, newlen);
+            if(!grown) {
+                err = Z_MEM_ERROR;
+                goto err;
+            }
+            out = grown;
 
             strm->next_out = (Bytef*)(out + outlen);
-            strm->avail_out = outlen;
-            outlen <<= 1;
+            strm->avail_out = newlen - outlen;
+            outlen = newlen;
             continue;
         }
 
@@ -54,6 +82,11 @@ static int zlib_loop(z_stream *strm, zlib_op op_func, char **buf, int *buflen) {
         }
     }
 
+    if(maxlen && strm->total_out > (mz_ulong)maxlen) {
+        err = ZLIB_TOO_LARGE;
+        goto err;
+    }
+
     *buf = out;
     *buflen = strm->total_out;
     return 0;
@@ -65,7 +98,51 @@ err:
     return err;
 }
 
-int inflate_data(const void *src, int srclen, char **dest_out, int *destlen_out) {
+/** Same as zlib_loop, but hands every filled chunk to sink instead of
+ * accumulating the whole output, so memory use stays at CHUNK_SIZE. */
+static int zlib_stream_loop(z_stream *strm, zlib_op op_func, int maxlen,
+        zlib_sink sink, void *ctx) {
+    char *out = (char *)strm->next_out;
+    int outlen = strm->avail_out;
+
+    int err, op = Z_NO_FLUSH;
+    for(;;) {
+        err = op_func(strm, op);
+        if(err != Z_OK && err != Z_STREAM_END) {
+            break;
+        }
+
+        if(maxlen && strm->total_out > (mz_ulong)maxlen) {
+            err = ZLIB_TOO_LARGE;
+            break;
+        }
+
+        if(strm->avail_out == 0 || err == Z_STREAM_END) {
+            int len = outlen - strm->avail_out;
+            if(len && sink(ctx, out, len)) {
+                err = ZLIB_SINK_ERROR;
+                break;
+            }
+            strm->next_out = (Bytef*)out;
+            strm->avail_out = outlen;
+        }
+
+        if(err == Z_STREAM_END) {
+            err = 0;
+            break;
+        }
+
+        if(strm->avail_in == 0) {
+            op = Z_FINISH;
+        }
+    }
+
+    free(out);
+    return err;
+}
+
+int inflate_data(const void *src, int srclen, int maxlen,
+        char **dest_out, int *destlen_out) {
     z_stream strm;
     memset(&strm, 0, sizeof(z_stream));
     if(init_stream(&strm, src, srclen)) {
@@ -75,11 +152,12 @@ int inflate_data(const void *src, int srclen, char **dest_out, int *destlen_out)
 
     if(inflateInit(&strm) != Z_OK) {
         printf("inflate: failed to inflateInit\n");
+        free(strm.next_out);
         inflateEnd(&strm);
         return -1;
     }
 
-    int err = zlib_loop(&strm, inflate, dest_out, destlen_out);
+    int err = zlib_loop(&strm, inflate, maxlen, dest_out, destlen_out);
     inflateEnd(&strm);
     if(err) {
         printf("inflate: failed to loop: %d\n", err);
@@ -89,6 +167,32 @@ int inflate_data(const void *src, int srclen, char **dest_out, int *destlen_out)
     return 0;
 }
 
+int inflate_stream(const void *src, int srclen, int maxlen,
+        zlib_sink sink, void *ctx) {
+    z_stream strm;
+    memset(&strm, 0, sizeof(z_stream));
+    if(init_stream(&strm, src, srclen)) {
+        printf("inflate: failed to init stream\n");
+        return -1;
+    }
+
+    if(inflateInit(&strm) != Z_OK) {
+        printf("inflate: failed to inflateInit\n");
+        free(strm.next_out);
+        inflateEnd(&strm);
+        return -1;
+    }
+
+    int err = zlib_stream_loop(&strm, inflate, maxlen, sink, ctx);
+    inflateEnd(&strm);
+    if(err) {
+        printf("inflate: failed to stream: %d\n", err);
+        return err;
+    }
+
+    return 0;
+}
+
 int deflate_data(const void *src, int srclen,
         char ** dest_out, int *destlen_out) {
     z_stream strm;
@@ -104,7 +208,7 @@ int deflate_data(const void *src, int srclen,
         return -1;
     }
 
-    int err = zlib_loop(&strm, deflate, dest_out, destlen_out);
+    int err = zlib_loop(&strm, deflate, 0, dest_out, destlen_out);
     deflateEnd(&strm);
     if(err) {
         printf("deflate error: %d\n", err);
@@ -150,37 +254,720 @@ enum NaclReqType {
     BoxOpen,
     DeflateBox,
     InflateBoxOpen,
+    InflateBoxOpenStream,
     Sign,
     SignOpen,
 
     SecretBox,
     SecretBoxOpen,
 };
+#define NACL_REQ_TYPES (SecretBoxOpen + 1)
+
+static const char *req_type_names[NACL_REQ_TYPES] = {
+    "box",
+    "box_open",
+    "deflate_box",
+    "inflate_box_open",
+    "inflate_box_open_stream",
+    "sign",
+    "sign_open",
+    "secretbox",
+    "secretbox_open",
+};
 
 enum CallType {
     Sync,
     Async,
 };
 
+/** Chunks produced on the worker thread, delivered to ondata on the loop.
+ * The worker waits while STREAM_MAX_CHUNKS are pending, so a slow loop
+ * holds back the inflate instead of letting the plaintext pile up. */
+#define STREAM_MAX_CHUNKS 4
+
+struct NaclStream {
+    uv_async_t async;
+    uv_mutex_t lock;
+    uv_cond_t drained; // Signalled when chunks are taken
+    vector<string> chunks;
+    bool aborted; // ondata threw; the worker stops at its next chunk
+    Persistent<Function> ondata;
+    size_t total; // Bytes handed to the sink, for stats
+};
+
 struct NaclReq {
     uv_work_t request;
     Persistent<Function> callback;
     
     NaclReqType type;
     string m, n, pk, sk;
+    int maxlen; // Upper bound of inflated size, 0 for no limit
+    NaclStream *stream;
 
     bool success;
     string c, err;
-
-    void init(const Arguments&, NaclReqType, CallType);
+    uint64_t queued_at; // uv_hrtime() when handed to the threadpool
+    uint32_t trace_id; // 0 unless sampled for tracing
+    struct TraceRing *trace_ring;
+    uint64_t trace_mark; // cpucycles() at the end of the previous stage
+    int priority; // NaclPriority lane
+    uint64_t deadline; // uv_hrtime() by which it must start, 0 for none
+    size_t admitted; // Bytes counted against the in-flight limits, 0 if none
+    struct NaclLoop *home; // Instance whose loop runs the callback
+    class NaclKey *key; // Key object given in place of key Buffers
+    bool key_destroyed; // key was destroyed before this request
+
+    bool init(const Arguments&, NaclReqType, CallType);
     void process();
+    void execute();
+    const unsigned char *box_key(string &k);
     Handle<Value> returnVal();
 };
 
+/** Runtime statistics.
+ * Each thread counts into its own NaclThreadStats, written only by that
+ * thread, so the hot path takes no locks; stats() sums all of them.
+ * Failures are rare and go into a shared map under stats_lock. */
+
+// Log-linear histogram: exact below HIST_SUB, then HIST_SUB buckets per
+// power of two
+#define HIST_SUB_BITS 2
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS ((65 - HIST_SUB_BITS) << HIST_SUB_BITS)
+
+struct NaclHist {
+    uint64_t counts[HIST_BUCKETS];
+};
+
+static int hist_bucket(uint64_t v) {
+    if(v < HIST_SUB) {
+        return (int)v;
+    }
+    int exp = 63 - __builtin_clzll(v) - HIST_SUB_BITS;
+    return exp * HIST_SUB + (int)(v >> exp);
+}
+
+// Largest value that lands in bucket b
+static uint64_t hist_upper(int b) {
+    if(b < HIST_SUB) {
+        return b;
+    }
+    int exp = b / HIST_SUB - 1;
+    uint64_t sub = b - exp * HIST_SUB;
+    return ((sub + 1) << exp) - 1;
+}
+
+struct NaclTypeStats {
+    uint64_t ops, inline_ops, bytes_in, bytes_out;
+    NaclHist queue_wait, exec;
+};
+
+struct NaclThreadStats {
+    NaclTypeStats types[NACL_REQ_TYPES];
+    NaclThreadStats *next;
+};
+
+static uv_mutex_t stats_lock;
+static NaclThreadStats *stats_threads = NULL;
+static __thread NaclThreadStats *stats_self = NULL;
+static map<string, uint64_t> stats_failures[NACL_REQ_TYPES];
+static NaclThreadStats stats_base; // Totals at the last stats_reset()
+static long stats_queued = 0; // Requests waiting for a threadpool thread
+
+// Only the owning thread writes; the relaxed store keeps readers on other
+// threads from seeing torn values
+static inline void stat_add(uint64_t *x, uint64_t n) {
+    __atomic_store_n(x, *x + n, __ATOMIC_RELAXED);
+}
+
+static NaclTypeStats *thread_stats(NaclReqType type) {
+    if(!stats_self) {
+        stats_self = new NaclThreadStats();
+        memset(stats_self, 0, sizeof(NaclThreadStats));
+        uv_mutex_lock(&stats_lock);
+        stats_self->next = stats_threads;
+        stats_threads = stats_self;
+        uv_mutex_unlock(&stats_lock);
+    }
+    return &stats_self->types[type];
+}
+
+static void stats_fail(NaclReq *req) {
+    uv_mutex_lock(&stats_lock);
+    stats_failures[req->type][req->err]++;
+    uv_mutex_unlock(&stats_lock);
+}
+
+static void stats_record(NaclReq *req, size_t in, uint64_t start, uint64_t end) {
+    NaclTypeStats *ts = thread_stats(req->type);
+    stat_add(&ts->ops, 1);
+    stat_add(&ts->bytes_in, in);
+    stat_add(&ts->bytes_out, req->stream ? req->stream->total : req->c.length());
+    stat_add(&ts->exec.counts[hist_bucket(end - start)], 1);
+    if(req->queued_at) {
+        stat_add(&ts->queue_wait.counts[hist_bucket(start - req->queued_at)], 1);
+    }
+    if(!req->success) {
+        stats_fail(req);
+    }
+}
+
+static void stats_sum(NaclThreadStats *sum) {
+    memset(sum, 0, sizeof(NaclThreadStats));
+    uv_mutex_lock(&stats_lock);
+    for(NaclThreadStats *t = stats_threads; t; t = t->next) {
+        uint64_t *src = (uint64_t *)t->types;
+        uint64_t *dst = (uint64_t *)sum->types;
+        for(size_t i = 0; i < sizeof(t->types) / (sizeof(uint64_t)); i++) {
+            dst[i] += __atomic_load_n(&src[i], __ATOMIC_RELAXED);
+        }
+    }
+    uv_mutex_unlock(&stats_lock);
+}
+
+/** Request tracing.
+ * Sampled requests log one event per stage into a ring buffer, stamped
+ * with cpucycles(). Writers claim slots with an atomic increment and
+ * publish them seqlock-style, so the worker threads never block each
+ * other or trace_export(). */
+
+enum TraceStage {
+    TraceQueue, // From submission until a threadpool thread picks it up
+    TraceDeflate,
+    TraceBeforenm,
+    TraceAfternm,
+    TraceOpenAfternm,
+    TraceInflate,
+    TraceSign,
+    TraceSignOpen,
+    TraceSecretBox,
+    TraceSecretBoxOpen,
+    TraceDeliver, // From the end of the work until the loop runs the callback
+    TraceCallback,
+};
+
+static const char *trace_stage_names[] = {
+    "queue",
+    "deflate",
+    "beforenm",
+    "afternm",
+    "open_afternm",
+    "inflate",
+    "sign",
+    "sign_open",
+    "secretbox",
+    "secretbox_open",
+    "deliver",
+    "callback",
+};
+
+struct TraceEvent {
+    uint64_t seq; // Slot index + 1 once written, 0 while being written
+    uint64_t begin, end;
+    uint64_t info; // req id << 32 | tid << 16 | type << 8 | stage
+};
+
+struct TraceRing {
+    TraceEvent *events;
+    uint64_t capacity;
+    uint64_t head; // Slots claimed so far
+};
+
+#define TRACE_DEFAULT_CAPACITY 65536
+
+static TraceRing *trace_ring = NULL;
+static int trace_on = 0;
+static uint64_t trace_period = 1; // Trace one request in every trace_period
+static uint64_t trace_count = 0;
+static uint32_t trace_next_id = 0;
+static uint32_t trace_next_tid = 0;
+static __thread uint32_t trace_tid = 0;
+static uint64_t trace_start_cycles, trace_start_ns;
+
+static void trace_sample(NaclReq *req) {
+    req->trace_id = 0;
+    if(!__atomic_load_n(&trace_on, __ATOMIC_RELAXED)) {
+        return;
+    }
+    if(__sync_fetch_and_add(&trace_count, 1) % trace_period) {
+        return;
+    }
+    req->trace_ring = trace_ring;
+    do {
+        req->trace_id = __sync_add_and_fetch(&trace_next_id, 1);
+    } while(!req->trace_id);
+    req->trace_mark = cpucycles();
+}
+
+static void trace_emit(NaclReq *req, TraceStage stage, uint64_t begin, uint64_t end) {
+    TraceRing *ring = req->trace_ring;
+    if(!trace_tid) {
+        trace_tid = __sync_add_and_fetch(&trace_next_tid, 1);
+    }
+    uint64_t slot = __sync_fetch_and_add(&ring->head, 1);
+    TraceEvent *e = &ring->events[slot % ring->capacity];
+    __atomic_store_n(&e->seq, 0, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    __atomic_store_n(&e->begin, begin, __ATOMIC_RELAXED);
+    __atomic_store_n(&e->end, end, __ATOMIC_RELAXED);
+    __atomic_store_n(&e->info, (uint64_t)req->trace_id << 32
+        | (uint64_t)(trace_tid & 0xffff) << 16 | req->type << 8 | stage, __ATOMIC_RELAXED);
+    __atomic_store_n(&e->seq, slot + 1, __ATOMIC_RELEASE);
+}
+
+// Ends the current stage of a sampled request
+static inline void trace_stage(NaclReq *req, TraceStage stage) {
+    if(!req->trace_id) {
+        return;
+    }
+    uint64_t now = cpucycles();
+    trace_emit(req, stage, req->trace_mark, now);
+    req->trace_mark = now;
+}
+
+static string box_beforenm(const string &pk, const string &sk) {
+    if (pk.size() != crypto_box_PUBLICKEYBYTES) throw "incorrect public-key length";
+    if (sk.size() != crypto_box_SECRETKEYBYTES) throw "incorrect secret-key length";
+    unsigned char k[crypto_box_BEFORENMBYTES];
+    crypto_box_beforenm(k, (const unsigned char *)pk.c_str(),
+        (const unsigned char *)sk.c_str());
+    return string((char *)k, sizeof(k));
+}
+
+// crypto_secretbox and crypto_secretbox_open, with the key as bytes
+// that need not be copied into a string
+static string secretbox_seal(const string &m, const string &n, const unsigned char *k) {
+    if (n.size() != crypto_secretbox_NONCEBYTES) throw "incorrect nonce length";
+    size_t len = m.size() + crypto_secretbox_ZEROBYTES;
+    string in(crypto_secretbox_ZEROBYTES, 0), out(len, 0);
+    in += m;
+    crypto_secretbox((unsigned char *)&out[0], (const unsigned char *)in.data(), len,
+        (const unsigned char *)n.data(), k);
+    return out.substr(crypto_secretbox_BOXZEROBYTES);
+}
+
+static string secretbox_unseal(const string &c, const string &n, const unsigned char *k) {
+    if (n.size() != crypto_secretbox_NONCEBYTES) throw "incorrect nonce length";
+    size_t len = c.size() + crypto_secretbox_BOXZEROBYTES;
+    string in(crypto_secretbox_BOXZEROBYTES, 0), out(len, 0);
+    in += c;
+    if (crypto_secretbox_open((unsigned char *)&out[0], (const unsigned char *)in.data(), len,
+            (const unsigned char *)n.data(), k) != 0)
+        throw "ciphertext fails verification";
+    if (len < crypto_secretbox_ZEROBYTES)
+        throw "ciphertext too short";
+    return out.substr(crypto_secretbox_ZEROBYTES);
+}
+
+static string sign_expanded(const string &m, const unsigned char *esk) {
+    string sm(m.size() + crypto_sign_BYTES, 0);
+    unsigned long long smlen;
+    crypto_sign_expanded((unsigned char *)&sm[0], &smlen,
+        (const unsigned char *)m.data(), m.size(), esk);
+    sm.resize(smlen);
+    return sm;
+}
+
+static string sign_open_expanded(const string &sm, const unsigned char *epk) {
+    if (sm.size() < crypto_sign_BYTES) throw "ciphertext fails verification";
+    string m(sm.size(), 0);
+    unsigned long long mlen;
+    if (crypto_sign_open_expanded((unsigned char *)&m[0], &mlen,
+            (const unsigned char *)sm.data(), sm.size(), epk) != 0)
+        throw "ciphertext fails verification";
+    m.resize(mlen);
+    return m;
+}
+
+/** Key objects.
+ * BoxKey, SignKey, VerifyKey and SecretKey hold key material prepared
+ * once, when they are constructed: the shared key from
+ * crypto_box_beforenm, the reduced signing scalar, the decompressed
+ * verification point. Operations given one in place of key Buffers skip
+ * that per-call setup. The material lives in its own mlocked mapping
+ * and destroy() wipes it, once async requests that already hold the key
+ * have finished. */
+
+enum NaclKeyKind {
+    KeyBox,
+    KeySign,
+    KeyVerify,
+    KeySecret,
+};
+#define NACL_KEY_KINDS (KeySecret + 1)
+
+static const char *key_kind_names[NACL_KEY_KINDS] = {
+    "BoxKey",
+    "SignKey",
+    "VerifyKey",
+    "SecretKey",
+};
+
+static const size_t key_kind_bytes[NACL_KEY_KINDS] = {
+    crypto_box_BEFORENMBYTES,
+    crypto_sign_EXPANDEDSECRETKEYBYTES,
+    crypto_sign_EXPANDEDPUBLICKEYBYTES,
+    crypto_secretbox_KEYBYTES,
+};
+
+static void wipe(void *p, size_t len) {
+    volatile unsigned char *v = (volatile unsigned char *)p;
+    while(len--) {
+        *v++ = 0;
+    }
+}
+
+class NaclKey : public ObjectWrap {
+public:
+    NaclKeyKind kind;
+    unsigned char *data; // NULL once wiped
+    size_t map_len;
+    int users; // Async requests holding the key
+    bool destroyed;
+
+    NaclKey(NaclKeyKind kind) : kind(kind), data(NULL), map_len(0),
+            users(0), destroyed(false) {
+        size_t page = sysconf(_SC_PAGESIZE);
+        map_len = (key_kind_bytes[kind] + page - 1) / page * page;
+        void *p = mmap(NULL, map_len, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if(p == MAP_FAILED) {
+            return;
+        }
+        // Best effort; RLIMIT_MEMLOCK may not allow it
+        mlock(p, map_len);
+#ifdef MADV_DONTDUMP
+        madvise(p, map_len, MADV_DONTDUMP);
+#endif
+        data = (unsigned char *)p;
+    }
+
+    ~NaclKey() {
+        wipe_data();
+    }
+
+    void wipe_data() {
+        if(!data) {
+            return;
+        }
+        wipe(data, map_len);
+        munlock(data, map_len);
+        munmap(data, map_len);
+        data = NULL;
+    }
+
+    // Keeps the key and its material until release()
+    void acquire() {
+        users++;
+        Ref();
+    }
+
+    void release() {
+        if(!--users && destroyed) {
+            wipe_data();
+        }
+        Unref();
+    }
+
+    void destroy() {
+        destroyed = true;
+        if(!users) {
+            wipe_data();
+        }
+    }
+
+    static Handle<Value> New(const Arguments& args);
+};
+
+static void key_prepare(NaclKey *key, const Arguments &args) {
+    const unsigned char *a = (const unsigned char *)Buffer::Data(args[0]);
+    size_t alen = Buffer::Length(args[0]);
+    switch(key->kind) {
+    case KeyBox:
+        if (alen != crypto_box_PUBLICKEYBYTES) throw "incorrect public-key length";
+        if (Buffer::Length(args[1]) != crypto_box_SECRETKEYBYTES) throw "incorrect secret-key length";
+        crypto_box_beforenm(key->data, a, (const unsigned char *)Buffer::Data(args[1]));
+        break;
+    case KeySign:
+        if (alen != crypto_sign_SECRETKEYBYTES) throw "incorrect secret-key length";
+        crypto_sign_expandsk(key->data, a);
+        break;
+    case KeyVerify:
+        if (alen != crypto_sign_PUBLICKEYBYTES) throw "incorrect public-key length";
+        if (crypto_sign_expandpk(key->data, a) != 0) throw "invalid public key";
+        break;
+    case KeySecret:
+        if (alen != crypto_secretbox_KEYBYTES) throw "incorrect key length";
+        memcpy(key->data, a, alen);
+        break;
+    }
+}
+
+/** new BoxKey(pk, sk), new SignKey(sk), new VerifyKey(pk),
+ * new SecretKey(k); the kind comes in as the template's data */
+Handle<Value> NaclKey::New(const Arguments& args) {
+    HandleScope scope;
+    NaclKeyKind kind = (NaclKeyKind)args.Data()->Int32Value();
+    if(!args.IsConstructCall()) {
+        return ThrowException(Exception::TypeError(
+            String::New("use new to construct a key")));
+    }
+    int nargs = kind == KeyBox ? 2 : 1;
+    for(int i = 0; i < nargs; i++) {
+        if(!Buffer::HasInstance(args[i])) {
+            return ThrowException(Exception::TypeError(
+                String::New("key arguments must be Buffers")));
+        }
+    }
+
+    NaclKey *key = new NaclKey(kind);
+    if(!key->data) {
+        delete key;
+        return ThrowException(Exception::Error(
+            String::New("unable to allocate key memory")));
+    }
+    try {
+        key_prepare(key, args);
+    } catch(const char *e) {
+        delete key;
+        return ThrowException(Exception::Error(String::New(e)));
+    }
+    key->Wrap(args.This());
+    return args.This();
+}
+
+/** destroy(): wipes the key; requests already given it still complete,
+ * later ones fail with "key destroyed" */
+static Handle<Value> nacl_key_destroy (const Arguments& args) {
+    ObjectWrap::Unwrap<NaclKey>(args.This())->destroy();
+    return Undefined();
+}
+
+
+/** Cost model for running small async requests inline.
+ * Each type's cost is estimated as fixed + per_kb * bytes / 1024 ns,
+ * seeded with rough figures and then tracked from measured execution
+ * times: short messages refine the fixed part, long ones the per-byte
+ * part. Requests given a key object skip the per-call key setup (a
+ * scalarmult for box, point decompression for sign_open), so they are
+ * costed apart from raw-key ones; otherwise cheap keyed traffic would
+ * pull raw-key requests under the threshold. Async requests estimated
+ * under inline_threshold ns skip the threadpool, which costs more than
+ * the work itself for them. */
+
+#define INLINE_DEFAULT_THRESHOLD 10000
+#define COST_SHORT_MESSAGE 1024
+
+// Indexed by [keyed][type]
+static uint64_t cost_fixed[2][NACL_REQ_TYPES] = {{
+    60000,  // box: dominated by beforenm
+    60000,  // box_open
+    80000,  // deflate_box
+    80000,  // inflate_box_open
+    80000,  // inflate_box_open_stream
+    150000, // sign
+    250000, // sign_open
+    1000,   // secretbox
+    1000,   // secretbox_open
+}, {
+    2000,   // box with a BoxKey: no beforenm
+    2000,   // box_open
+    20000,  // deflate_box
+    20000,  // inflate_box_open
+    20000,  // inflate_box_open_stream
+    140000, // sign with a SignKey: still a base scalarmult
+    230000, // sign_open with a VerifyKey: no decompression
+    1000,   // secretbox
+    1000,   // secretbox_open
+}};
+static uint64_t cost_per_kb[2][NACL_REQ_TYPES] = {
+    {4000, 4000, 40000, 12000, 12000, 8000, 8000, 4000, 4000},
+    {4000, 4000, 40000, 12000, 12000, 8000, 8000, 4000, 4000},
+};
+static uint64_t inline_threshold = INLINE_DEFAULT_THRESHOLD;
+
+static uint64_t cost_estimate(NaclReqType type, bool keyed, size_t len) {
+    return __atomic_load_n(&cost_fixed[keyed][type], __ATOMIC_RELAXED)
+        + __atomic_load_n(&cost_per_kb[keyed][type], __ATOMIC_RELAXED) * len / 1024;
+}
+
+// Moves the estimate an eighth of the way towards a measured run; racing
+// updates from several threads may drop a sample, which is harmless
+static void cost_learn(NaclReqType type, bool keyed, size_t len, uint64_t ns) {
+    uint64_t fixed = __atomic_load_n(&cost_fixed[keyed][type], __ATOMIC_RELAXED);
+    if(len <= COST_SHORT_MESSAGE) {
+        __atomic_store_n(&cost_fixed[keyed][type],
+            fixed - fixed / 8 + ns / 8, __ATOMIC_RELAXED);
+        return;
+    }
+    uint64_t per_kb = __atomic_load_n(&cost_per_kb[keyed][type], __ATOMIC_RELAXED);
+    uint64_t sample = ns > fixed ? (ns - fixed) * 1024 / len : 0;
+    __atomic_store_n(&cost_per_kb[keyed][type],
+        per_kb - per_kb / 8 + sample / 8, __ATOMIC_RELAXED);
+}
+
+/** Per-instance state.
+ * Everything bound to one event loop and its V8 context lives in a
+ * NaclLoop. init() creates one per instance and hands it to every
+ * binding function as the function's data, so a request always comes
+ * back to the loop that submitted it. Process-wide state (stats, trace
+ * rings, cost model, the threadpool lanes) is shared between instances
+ * and guarded by its own locks and atomics.
+ *
+ * An instance lives as long as the process: node 0.10 has no hook for
+ * tearing one down, and the binding functions never go away. */
+struct NaclLoop {
+    uv_loop_t *uv;
+
+    uv_async_t inline_async; // Runs the callbacks in inline_done
+    vector<NaclReq*> inline_done;
+    uv_async_t sched_async; // Runs the callbacks in sched_done
+    vector<NaclReq*> sched_done; // Guarded by sched_lock
+    size_t in_flight; // Submitted to the threadpool, callback not yet run
+    uv_async_t coalesce_async;
+    vector<NaclReq*> coalesce_pending;
+
+    uint64_t limit_requests, limit_bytes; // 0 for no limit
+    uint64_t load_requests, load_bytes;
+    bool load_full; // Hit a limit since the last drain
+    Persistent<Function> drain_cb;
+
+    // Key classes; keys are only recognised by the instance that made them
+    Persistent<FunctionTemplate> key_templates[NACL_KEY_KINDS];
+};
+
+static NaclLoop *loop_of(const Arguments &args) {
+    return static_cast<NaclLoop*>(Handle<External>::Cast(args.Data())->Value());
+}
+
+// The key object of this kind at arg, or NULL if arg is not one
+// of this instance
+static NaclKey *key_arg(NaclLoop *home, Handle<Value> arg, NaclKeyKind kind) {
+    if(!home->key_templates[kind]->HasInstance(arg)) {
+        return NULL;
+    }
+    return ObjectWrap::Unwrap<NaclKey>(arg->ToObject());
+}
+
+static void key_init(Handle<Object> target, NaclLoop *home) {
+    for(int kind = 0; kind < NACL_KEY_KINDS; kind++) {
+        Local<FunctionTemplate> t = FunctionTemplate::New(NaclKey::New,
+            Integer::New(kind));
+        Local<String> name = String::NewSymbol(key_kind_names[kind]);
+        t->SetClassName(name);
+        t->InstanceTemplate()->SetInternalFieldCount(1);
+        NODE_SET_PROTOTYPE_METHOD(t, "destroy", nacl_key_destroy);
+        home->key_templates[kind] = Persistent<FunctionTemplate>::New(t);
+        target->Set(name, t->GetFunction());
+    }
+}
+
+/** In-flight limits.
+ * Async requests count against the limits of their instance from
+ * submission until their callback has run. One that would go over is
+ * turned away with "busy" before it is queued, and once the load falls
+ * back to half the limits the ondrain callback given to set_limits()
+ * runs, so callers can stop and resume submitting instead of buffering
+ * without bound. Loop thread only. */
+
+static bool admit(NaclReq *req) {
+    NaclLoop *home = req->home;
+    size_t bytes = req->m.length() + 1;
+    if((home->limit_requests && home->load_requests >= home->limit_requests)
+            // A lone request larger than the byte limit still goes through
+            || (home->limit_bytes && home->load_requests
+                && home->load_bytes + bytes > home->limit_bytes)) {
+        home->load_full = true;
+        return false;
+    }
+    home->load_requests++;
+    home->load_bytes += bytes;
+    req->admitted = bytes;
+    if((home->limit_requests && home->load_requests >= home->limit_requests)
+            || (home->limit_bytes && home->load_bytes >= home->limit_bytes)) {
+        home->load_full = true;
+    }
+    return true;
+}
+
+// After the callback of an admitted request has run
+static void release(NaclReq *req) {
+    NaclLoop *home = req->home;
+    if(!req->admitted) {
+        return;
+    }
+    home->load_requests--;
+    home->load_bytes -= req->admitted;
+    if(!home->load_full
+            || (home->limit_requests && home->load_requests > home->limit_requests / 2)
+            || (home->limit_bytes && home->load_bytes > home->limit_bytes / 2)) {
+        return;
+    }
+    home->load_full = false;
+    if(!home->drain_cb.IsEmpty()) {
+        home->drain_cb->Call(Context::GetCurrent()->Global(), 0, NULL);
+    }
+}
+
+static void HandleStreamAsync(uv_async_t *handle, int status);
+
+static int stream_sink(void *ctx, const char *buf, int buflen) {
+    NaclStream *stream = static_cast<NaclStream*>(ctx);
+    uv_mutex_lock(&stream->lock);
+    while(stream->chunks.size() >= STREAM_MAX_CHUNKS && !stream->aborted) {
+        uv_cond_wait(&stream->drained, &stream->lock);
+    }
+    if(stream->aborted) {
+        uv_mutex_unlock(&stream->lock);
+        return -1;
+    }
+    stream->chunks.push_back(string(buf, buflen));
+    uv_mutex_unlock(&stream->lock);
+    uv_async_send(&stream->async);
+    stream->total += buflen;
+    return 0;
+}
+
+static const char *inflate_err_str(int err) {
+    if(err == ZLIB_TOO_LARGE) {
+        return "inflated data exceeds maxlen";
+    }
+    if(err == ZLIB_SINK_ERROR) {
+        return "stream aborted";
+    }
+    return "failed to inflate";
+}
+
 void NaclReq::process() {
+    // DeflateBox replaces m, so take the input size first
+    size_t in = this->m.length();
+    uint64_t start = uv_hrtime();
+    this->execute();
+    uint64_t end = uv_hrtime();
+    stats_record(this, in, start, end);
+    if(this->success) {
+        cost_learn(this->type, this->key != NULL, in, end - start);
+    }
+}
+
+// The box key: prepared if given as a BoxKey, else computed into k
+const unsigned char *NaclReq::box_key(string &k) {
+    if(this->key) {
+        return this->key->data;
+    }
+    k = box_beforenm(this->pk, this->sk);
+    trace_stage(this, TraceBeforenm);
+    return (const unsigned char *)k.data();
+}
+
+void NaclReq::execute() {
     char *out = NULL;
     int out_len = 0, err = 0;
+    string k;
     try {
+        if(this->key_destroyed) {
+            throw "key destroyed";
+        }
         switch(this->type) {
         case DeflateBox:
             // Deflate before box
@@ -190,38 +977,66 @@ void NaclReq::process() {
             }
             this->m = string(out, out_len);
             free(out);
-            this->c = crypto_box(this->m, this->n, this->pk, this->sk);
+            trace_stage(this, TraceDeflate);
+            this->c = secretbox_seal(this->m, this->n, box_key(k));
+            trace_stage(this, TraceAfternm);
             break;
 
         case Box:
-            this->c = crypto_box(this->m, this->n, this->pk, this->sk);
+            this->c = secretbox_seal(this->m, this->n, box_key(k));
+            trace_stage(this, TraceAfternm);
             break;
 
         case BoxOpen:
-            this->c = crypto_box_open(this->m, this->n, this->pk, this->sk);
+            this->c = secretbox_unseal(this->m, this->n, box_key(k));
+            trace_stage(this, TraceOpenAfternm);
             break;
 
         case InflateBoxOpen:
-            this->c = crypto_box_open(this->m, this->n, this->pk, this->sk);
-            err = inflate_data(this->c.c_str(), this->c.length(), &out, &out_len);
+            this->c = secretbox_unseal(this->m, this->n, box_key(k));
+            trace_stage(this, TraceOpenAfternm);
+            err = inflate_data(this->c.c_str(), this->c.length(), this->maxlen,
+                &out, &out_len);
             if(err) {
-                this->err = "failed to inflate"; return;
+                this->err = inflate_err_str(err); return;
             }
             this->c = string(out, out_len);
             free(out);
+            trace_stage(this, TraceInflate);
+            break;
+
+        case InflateBoxOpenStream:
+            // Plaintext is only the compressed form, bounded by input size
+            this->c = secretbox_unseal(this->m, this->n, box_key(k));
+            trace_stage(this, TraceOpenAfternm);
+            err = inflate_stream(this->c.c_str(), this->c.length(), this->maxlen,
+                stream_sink, this->stream);
+            this->c.clear();
+            if(err) {
+                this->err = inflate_err_str(err); return;
+            }
+            trace_stage(this, TraceInflate);
             break;
 
         case Sign:
-            this->c = crypto_sign(this->m, this->sk);
+            this->c = this->key ? sign_expanded(this->m, this->key->data)
+                : crypto_sign(this->m, this->sk);
+            trace_stage(this, TraceSign);
             break;
         case SignOpen:
-            this->c = crypto_sign_open(this->m, this->sk);
+            this->c = this->key ? sign_open_expanded(this->m, this->key->data)
+                : crypto_sign_open(this->m, this->sk);
+            trace_stage(this, TraceSignOpen);
             break;
         case SecretBox:
-            this->c = crypto_secretbox(this->m, this->n, this->sk);
+            this->c = this->key ? secretbox_seal(this->m, this->n, this->key->data)
+                : crypto_secretbox(this->m, this->n, this->sk);
+            trace_stage(this, TraceSecretBox);
             break;
         case SecretBoxOpen:
-            this->c = crypto_secretbox_open(this->m, this->n, this->sk);
+            this->c = this->key ? secretbox_unseal(this->m, this->n, this->key->data)
+                : crypto_secretbox_open(this->m, this->n, this->sk);
+            trace_stage(this, TraceSecretBoxOpen);
             break;
         }
 
@@ -239,18 +1054,67 @@ Handle<Value> NaclReq::returnVal() {
     }
 }
 
-static void HandleReqAsync(uv_work_t *req) {
-    NaclReq *naclreq = static_cast<NaclReq*>(req->data);
-    naclreq->process();
+static void FlushStream(NaclStream *stream) {
+    HandleScope scope;
+    vector<string> chunks;
+    uv_mutex_lock(&stream->lock);
+    chunks.swap(stream->chunks);
+    bool aborted = stream->aborted;
+    uv_cond_signal(&stream->drained);
+    uv_mutex_unlock(&stream->lock);
+
+    // ondata(chunk, queued): queued is how many chunks were waiting
+    for(size_t i = 0; i < chunks.size() && !aborted; i++) {
+        Handle<Value> argv[2] = { str_to_buf(chunks[i])->handle_,
+            Integer::New(chunks.size()) };
+        TryCatch try_catch;
+        stream->ondata->Call(Context::GetCurrent()->Global(), 2, argv);
+        if(try_catch.HasCaught()) {
+            // Drop the rest; the callback gets "stream aborted"
+            uv_mutex_lock(&stream->lock);
+            stream->aborted = aborted = true;
+            stream->chunks.clear();
+            uv_cond_signal(&stream->drained);
+            uv_mutex_unlock(&stream->lock);
+            FatalException(try_catch);
+        }
+    }
+}
+
+static void HandleStreamAsync(uv_async_t *handle, int status) {
+    FlushStream(static_cast<NaclStream*>(handle->data));
+}
+
+static void HandleStreamClose(uv_handle_t *handle) {
+    NaclStream *stream = static_cast<NaclStream*>(handle->data);
+    stream->ondata.Dispose();
+    uv_cond_destroy(&stream->drained);
+    uv_mutex_destroy(&stream->lock);
+    delete stream;
 }
 
 static void HandleReqAsyncAfter(uv_work_t *req, int n) {
     NaclReq *naclreq = static_cast<NaclReq*>(req->data);
+    trace_stage(naclreq, TraceDeliver);
+
+    if(naclreq->stream) {
+        // Pending async sends may not have fired yet; chunks go out first
+        FlushStream(naclreq->stream);
+        uv_close((uv_handle_t*)&naclreq->stream->async, HandleStreamClose);
+        if(naclreq->stream->aborted && naclreq->success) {
+            naclreq->success = false;
+            naclreq->err = "stream aborted";
+        }
+    }
 
     Handle<Value> argv[2];
     if(naclreq->success) {
         argv[0] = Null();
-        argv[1] = str_to_buf(naclreq->c)->handle_;
+        if(naclreq->stream) {
+            argv[1] = Undefined();
+        } else {
+            argv[1] = str_to_buf(naclreq->c)->handle_;
+        }
     } else {
         argv[0] = String::New(naclreq->err.c_str());
         argv[1] = Null();
@@ -258,30 +1122,399 @@ static void HandleReqAsyncAfter(uv_work_t *req, int n) {
 
     naclreq->callback->Call(Context::GetCurrent()->Global(),
         2, argv);
+    trace_stage(naclreq, TraceCallback);
     naclreq->callback.Dispose();
+    release(naclreq);
+    if(naclreq->key) {
+        naclreq->key->release();
+    }
     delete naclreq;
 }
 
-void NaclReq::init(const Arguments &args, NaclReqType type, CallType callType) {
+/** Requests run inline, waiting for their callbacks. They are all
+ * delivered together on the next loop iteration, never from inside the
+ * call that submitted them. */
+
+// Runs the callbacks of finished requests; one throwing callback does
+// not keep the others from running
+static void deliver_all(vector<NaclReq*> &done) {
+    for(size_t i = 0; i < done.size(); i++) {
+        HandleScope scope;
+        TryCatch try_catch;
+        HandleReqAsyncAfter(&done[i]->request, 0);
+        if(try_catch.HasCaught()) {
+            FatalException(try_catch);
+        }
+    }
+}
+
+static void HandleInlineAsync(uv_async_t *handle, int status) {
+    NaclLoop *home = static_cast<NaclLoop*>(handle->data);
+    vector<NaclReq*> done;
+    done.swap(home->inline_done);
+    uv_unref((uv_handle_t*)&home->inline_async);
+    deliver_all(done);
+}
+
+static void reject_busy(NaclReq *req) {
+    NaclLoop *home = req->home;
+    req->err = "busy";
+    stats_fail(req);
+    req->m.clear();
+    if(home->inline_done.empty()) {
+        uv_ref((uv_handle_t*)&home->inline_async);
+        uv_async_send(&home->inline_async);
+    }
+    home->inline_done.push_back(req);
+}
+
+static bool run_inline(NaclReq *req) {
+    // Streams hand chunks out as they go; keep them off the loop thread
+    if(req->type == InflateBoxOpenStream || !inline_threshold) {
+        return false;
+    }
+    if(cost_estimate(req->type, req->key != NULL, req->m.length()) > inline_threshold) {
+        return false;
+    }
+
+    NaclLoop *home = req->home;
+    req->process();
+    stat_add(&thread_stats(req->type)->inline_ops, 1);
+    if(home->inline_done.empty()) {
+        // Keep the loop alive until the callbacks have run
+        uv_ref((uv_handle_t*)&home->inline_async);
+        uv_async_send(&home->inline_async);
+    }
+    home->inline_done.push_back(req);
+    return true;
+}
+
+/** Scheduling.
+ * Async requests bound for the threadpool wait in one of three priority
+ * lanes. Runner work items take the front of the highest non-empty lane
+ * whenever they are free, so an interactive request never waits behind
+ * bulk work that has not started. There is at most one runner per
+ * threadpool thread but one, and each runs at most RUNNER_BATCH
+ * requests before going to the back of the threadpool queue, so fs, dns
+ * and zlib work still gets threads under sustained load.
+ * A request whose deadline has passed by then fails with "deadline
+ * exceeded" without running.
+ *
+ * Requests submitted within one loop iteration enter the lanes together
+ * when it ends, and finished requests come back through one uv_async
+ * that runs all their callbacks, so a burst of small calls costs a
+ * handful of queue hops and wakeups rather than one each.
+ *
+ * The lanes and runners are shared by all instances, like the threadpool
+ * itself; each finished request goes to the done list of its own
+ * NaclLoop. */
+
+enum NaclPriority {
+    Interactive,
+    Normal,
+    Bulk,
+};
+#define NACL_PRIORITIES (Bulk + 1)
+#define MULTI_MAX 8 // Secretboxes per multi-box call
+
+static uv_mutex_t sched_lock; // Guards the lanes, runner count and done lists
+static deque<NaclReq*> sched_lanes[NACL_PRIORITIES];
+static size_t sched_runners = 0; // Runner work items queued or running
+static size_t sched_max_runners = 3; // UV_THREADPOOL_SIZE - 1
+#define RUNNER_BATCH MULTI_MAX // Requests per runner work item
+static bool coalesce_on = true;
+
+/** Seals or opens every secretbox request in reqs (all of one type) with
+ * the multi-box primitive, several boxes per XSalsa20 pass */
+static void process_secretbox_multi(vector<NaclReq*> &reqs) {
+    size_t num = reqs.size();
+    bool open = reqs[0]->type == SecretBoxOpen;
+    size_t zero = open ? crypto_secretbox_BOXZEROBYTES : crypto_secretbox_ZEROBYTES;
+    vector<string> in(num), out(num);
+    vector<unsigned char *> outp(num);
+    vector<const unsigned char *> inp(num), np(num), kp(num);
+    vector<unsigned long long> len(num);
+    vector<int> result(num);
+    vector<size_t> inlen(num);
+
+    uint64_t start = uv_hrtime();
+    for(size_t i = 0; i < num; i++) {
+        NaclReq *req = reqs[i];
+        inlen[i] = req->m.length();
+        in[i].assign(zero, 0);
+        in[i] += req->m;
+        out[i].resize(in[i].length());
+        len[i] = in[i].length();
+        inp[i] = (const unsigned char *)in[i].data();
+        outp[i] = (unsigned char *)&out[i][0];
+        np[i] = (const unsigned char *)req->n.data();
+        kp[i] = req->key ? req->key->data : (const unsigned char *)req->sk.data();
+    }
+
+    if(open) {
+        crypto_secretbox_open_multi(&outp[0], &inp[0], &len[0], &np[0], &kp[0],
+            &result[0], num);
+    } else {
+        crypto_secretbox_multi(&outp[0], &inp[0], &len[0], &np[0], &kp[0], num);
+    }
+    uint64_t end = uv_hrtime();
+
+    // Shares of one pass; per-request execution time is not observable
+    uint64_t share = (end - start) / num;
+    for(size_t i = 0; i < num; i++) {
+        NaclReq *req = reqs[i];
+        if(open && result[i]) {
+            req->err = "ciphertext fails verification";
+        } else if(open) {
+            req->c = out[i].substr(crypto_secretbox_ZEROBYTES);
+            req->success = true;
+        } else {
+            req->c = out[i].substr(crypto_secretbox_BOXZEROBYTES);
+            req->success = true;
+        }
+        trace_stage(req, open ? TraceSecretBoxOpen : TraceSecretBox);
+        stats_record(req, inlen[i], end - share, end);
+    }
+}
+
+static bool multi_eligible(NaclReq *req) {
+    return (req->type == SecretBox || req->type == SecretBoxOpen)
+        && (req->key ? !req->key_destroyed
+            : req->sk.length() == crypto_secretbox_KEYBYTES)
+        && req->n.length() == crypto_secretbox_NONCEBYTES;
+}
+
+// Takes the front request of the highest non-empty lane, plus any
+// secretboxes of the same type right behind it; sched_lock held
+static void sched_take(vector<NaclReq*> &reqs) {
+    for(int p = 0; p < NACL_PRIORITIES; p++) {
+        deque<NaclReq*> &lane = sched_lanes[p];
+        if(lane.empty()) {
+            continue;
+        }
+        reqs.push_back(lane.front());
+        lane.pop_front();
+        if(!multi_eligible(reqs[0])) {
+            return;
+        }
+        while(reqs.size() < MULTI_MAX && !lane.empty()
+                && multi_eligible(lane.front()) && lane.front()->type == reqs[0]->type) {
+            reqs.push_back(lane.front());
+            lane.pop_front();
+        }
+        return;
+    }
+}
+
+static void HandleRunner(uv_work_t *work) {
+    vector<NaclReq*> reqs, live;
+    for(size_t ran = 0;; ran += reqs.size()) {
+        reqs.clear();
+        uv_mutex_lock(&sched_lock);
+        if(ran < RUNNER_BATCH) {
+            sched_take(reqs);
+        }
+        if(reqs.empty()) {
+            // Checked and given up under the lock, so sched_push either
+            // sees this runner gone or this runner sees its requests;
+            // HandleRunnerAfter replaces it if work is left
+            sched_runners--;
+            uv_mutex_unlock(&sched_lock);
+            return;
+        }
+        uv_mutex_unlock(&sched_lock);
+        __sync_fetch_and_sub(&stats_queued, reqs.size());
+
+        uint64_t now = uv_hrtime();
+        live.clear();
+        for(size_t i = 0; i < reqs.size(); i++) {
+            NaclReq *req = reqs[i];
+            trace_stage(req, TraceQueue);
+            if(req->deadline && now > req->deadline) {
+                req->err = "deadline exceeded";
+                stats_fail(req);
+            } else {
+                live.push_back(req);
+            }
+        }
+        if(live.size() > 1) {
+            process_secretbox_multi(live);
+        } else if(live.size()) {
+            live[0]->process();
+        }
+
+        // Sent under the lock: once a loop has taken its requests back
+        // no runner touches its NaclLoop again
+        uv_mutex_lock(&sched_lock);
+        for(size_t i = 0; i < reqs.size(); i++) {
+            reqs[i]->home->sched_done.push_back(reqs[i]);
+            uv_async_send(&reqs[i]->home->sched_async);
+        }
+        uv_mutex_unlock(&sched_lock);
+    }
+}
+
+static void HandleRunnerAfter(uv_work_t *work, int status);
+
+// Queues runners for the waiting requests, up to sched_max_runners;
+// sched_lock held, released on return
+static void sched_start(uv_loop_t *uv) {
+    size_t waiting = 0;
+    for(int p = 0; p < NACL_PRIORITIES; p++) {
+        waiting += sched_lanes[p].size();
+    }
+    size_t want = waiting < sched_max_runners ? waiting : sched_max_runners;
+    size_t start = want > sched_runners ? want - sched_runners : 0;
+    sched_runners += start;
+    uv_mutex_unlock(&sched_lock);
+
+    for(size_t i = 0; i < start; i++) {
+        uv_work_t *work = new uv_work_t();
+        work->data = uv;
+        uv_queue_work(uv, work, HandleRunner, HandleRunnerAfter);
+    }
+}
+
+static void HandleRunnerAfter(uv_work_t *work, int status) {
+    uv_loop_t *uv = static_cast<uv_loop_t*>(work->data);
+    delete work;
+    uv_mutex_lock(&sched_lock);
+    sched_start(uv);
+}
+
+static void sched_push(vector<NaclReq*> &reqs) {
+    if(reqs.empty()) {
+        return;
+    }
+    uv_mutex_lock(&sched_lock);
+    for(size_t i = 0; i < reqs.size(); i++) {
+        sched_lanes[reqs[i]->priority].push_back(reqs[i]);
+    }
+    sched_start(reqs[0]->home->uv);
+}
+
+static void HandleSchedAsync(uv_async_t *handle, int status) {
+    NaclLoop *home = static_cast<NaclLoop*>(handle->data);
+    vector<NaclReq*> done;
+    uv_mutex_lock(&sched_lock);
+    done.swap(home->sched_done);
+    uv_mutex_unlock(&sched_lock);
+
+    // Callbacks may submit more, so settle the count first
+    home->in_flight -= done.size();
+    if(!home->in_flight) {
+        uv_unref((uv_handle_t*)&home->sched_async);
+    }
+    deliver_all(done);
+}
+
+static void HandleCoalesceAsync(uv_async_t *handle, int status) {
+    NaclLoop *home = static_cast<NaclLoop*>(handle->data);
+    vector<NaclReq*> reqs;
+    reqs.swap(home->coalesce_pending);
+    uv_unref((uv_handle_t*)&home->coalesce_async);
+    sched_push(reqs);
+}
+
+static void submit(NaclReq *req) {
+    NaclLoop *home = req->home;
+    req->queued_at = uv_hrtime();
+    __sync_fetch_and_add(&stats_queued, 1);
+    // Keep the loop alive until the callback has run
+    if(!home->in_flight++) {
+        uv_ref((uv_handle_t*)&home->sched_async);
+    }
+    if(!coalesce_on) {
+        vector<NaclReq*> one(1, req);
+        sched_push(one);
+        return;
+    }
+    if(home->coalesce_pending.empty()) {
+        uv_ref((uv_handle_t*)&home->coalesce_async);
+        uv_async_send(&home->coalesce_async);
+    }
+    home->coalesce_pending.push_back(req);
+}
+
+static const char *priority_names[NACL_PRIORITIES] = {
+    "interactive",
+    "normal",
+    "bulk",
+};
+
+// { priority: "interactive" | "normal" | "bulk", deadline: ms }; anything
+// unrecognised leaves the default
+static void parse_options(NaclReq *req, Handle<Object> opts) {
+    Local<Value> priority = opts->Get(String::NewSymbol("priority"));
+    if(priority->IsString()) {
+        String::AsciiValue name(priority);
+        for(int p = 0; p < NACL_PRIORITIES; p++) {
+            if(!strcmp(*name, priority_names[p])) {
+                req->priority = p;
+            }
+        }
+    }
+    Local<Value> deadline = opts->Get(String::NewSymbol("deadline"));
+    if(deadline->IsNumber() && deadline->NumberValue() >= 0) {
+        req->deadline = uv_hrtime() + (uint64_t)(deadline->NumberValue() * 1e6);
+    }
+}
+
+static int maxlen_arg(Handle<Value> arg) {
+    int64_t maxlen = arg->IntegerValue();
+    // Anything an int sized buffer can't hold anyway means no limit
+    if(maxlen <= 0 || maxlen >= INT_MAX) {
+        return 0;
+    }
+    return (int)maxlen;
+}
+
+/** Parses the arguments and, for async calls, submits the request.
+ * Returns false if the request was turned away as busy; its callback
+ * still runs, with the error. */
+bool NaclReq::init(const Arguments &args, NaclReqType type, CallType callType) {
     this->type = type;
+    this->maxlen = 0;
+    this->stream = NULL;
+    this->success = false;
+    this->queued_at = 0;
+    this->priority = Normal;
+    this->deadline = 0;
+    this->admitted = 0;
+    this->home = loop_of(args);
+    this->key = NULL;
+    this->key_destroyed = false;
+    trace_sample(this);
 
     int callbackIndex = 0;
     switch(type) {
-    case DeflateBox:
+    // A key object takes the place of the key Buffers
     case InflateBoxOpen:
+    case InflateBoxOpenStream:
+    case DeflateBox:
     case Box:
     case BoxOpen:
         this->m = buf_to_str(args[0]->ToObject());
         this->n = buf_to_str(args[1]->ToObject());
-        this->pk = buf_to_str(args[2]->ToObject());
-        this->sk = buf_to_str(args[3]->ToObject());
-        callbackIndex = 4;
+        if((this->key = key_arg(this->home, args[2], KeyBox))) {
+            callbackIndex = 3;
+        } else {
+            this->pk = buf_to_str(args[2]->ToObject());
+            this->sk = buf_to_str(args[3]->ToObject());
+            callbackIndex = 4;
+        }
+        if((type == InflateBoxOpen || type == InflateBoxOpenStream)
+                && args[callbackIndex]->IsNumber()) {
+            this->maxlen = maxlen_arg(args[callbackIndex++]);
+        }
         break;
 
     case Sign:
     case SignOpen:
         this->m = buf_to_str(args[0]->ToObject());
-        this->sk = buf_to_str(args[1]->ToObject());
+        if(!(this->key = key_arg(this->home, args[1], type == Sign ? KeySign : KeyVerify))) {
+            this->sk = buf_to_str(args[1]->ToObject());
+        }
         callbackIndex = 2;
         break;
 
@@ -289,23 +1522,53 @@ void NaclReq::init(const Arguments &args, NaclReqType type, CallType callType) {
     case SecretBoxOpen:
         this->m = buf_to_str(args[0]->ToObject());
         this->n = buf_to_str(args[1]->ToObject());
-        this->sk = buf_to_str(args[2]->ToObject());
+        if(!(this->key = key_arg(this->home, args[2], KeySecret))) {
+            this->sk = buf_to_str(args[2]->ToObject());
+        }
         callbackIndex = 3;
         break;
     }
 
+    if(this->key) {
+        this->key_destroyed = this->key->destroyed;
+        if(callType == Async) {
+            this->key->acquire();
+        }
+    }
+
+    if(type == InflateBoxOpenStream) {
+        Handle<Function> ondata = Handle<Function>::Cast(args[callbackIndex++]);
+        this->stream = new NaclStream();
+        this->stream->ondata = Persistent<Function>::New(ondata);
+        this->stream->async.data = this->stream;
+        this->stream->total = 0;
+        this->stream->aborted = false;
+        uv_mutex_init(&this->stream->lock);
+        uv_cond_init(&this->stream->drained);
+        uv_async_init(this->home->uv, &this->stream->async, HandleStreamAsync);
+    }
+
     if(callType == Async) {
+        if(args[callbackIndex]->IsObject() && !args[callbackIndex]->IsFunction()) {
+            parse_options(this, args[callbackIndex++]->ToObject());
+        }
         Handle<Function> cb = Handle<Function>::Cast(args[callbackIndex]);
         this->request.data = this;
         this->callback = Persistent<Function>::New(cb);
-        uv_queue_work(uv_default_loop(), &this->request, HandleReqAsync, HandleReqAsyncAfter);
+        if(!admit(this)) {
+            reject_busy(this);
+            return false;
+        }
+        if(!run_inline(this)) {
+            submit(this);
+        }
     }
+    return true;
 }
 
 static Handle<Value> nacl_box (const Arguments& args) {
     NaclReq *req = new NaclReq();
-    req->init(args, Box, Async);
-    return Undefined();
+    return Boolean::New(req->init(args, Box, Async));
 }
 
 static Handle<Value> nacl_box_sync (const Arguments& args) {
@@ -317,8 +1580,7 @@ static Handle<Value> nacl_box_sync (const Arguments& args) {
 
 static Handle<Value> nacl_deflate_box (const Arguments& args) {
     NaclReq *req = new NaclReq();
-    req->init(args, DeflateBox, Async);
-    return Undefined();
+    return Boolean::New(req->init(args, DeflateBox, Async));
 }
 
 static Handle<Value> nacl_deflate_box_sync (const Arguments& args) {
@@ -330,8 +1592,7 @@ static Handle<Value> nacl_deflate_box_sync (const Arguments& args) {
 
 static Handle<Value> nacl_box_open (const Arguments& args) {
     NaclReq *req = new NaclReq();
-    req->init(args, BoxOpen, Async);
-    return Undefined();
+    return Boolean::New(req->init(args, BoxOpen, Async));
 }
 
 static Handle<Value> nacl_box_open_sync (const Arguments& args) {
@@ -343,8 +1604,7 @@ static Handle<Value> nacl_box_open_sync (const Arguments& args) {
 
 static Handle<Value> nacl_inflate_box_open (const Arguments& args) {
     NaclReq *req = new NaclReq();
-    req->init(args, InflateBoxOpen, Async);
-    return Undefined();
+    return Boolean::New(req->init(args, InflateBoxOpen, Async));
 }
 
 static Handle<Value> nacl_inflate_box_open_sync (const Arguments& args) {
@@ -354,6 +1614,11 @@ static Handle<Value> nacl_inflate_box_open_sync (const Arguments& args) {
     return req.returnVal();
 }
 
+static Handle<Value> nacl_inflate_box_open_stream (const Arguments& args) {
+    NaclReq *req = new NaclReq();
+    return Boolean::New(req->init(args, InflateBoxOpenStream, Async));
+}
+
 
 static Handle<Value> nacl_box_keypair (const Arguments& args) {
     HandleScope scope;
@@ -368,8 +1633,7 @@ static Handle<Value> nacl_box_keypair (const Arguments& args) {
 
 static Handle<Value> nacl_sign (const Arguments& args) {
     NaclReq *req = new NaclReq();
-    req->init(args, Sign, Async);
-    return Undefined();
+    return Boolean::New(req->init(args, Sign, Async));
 }
 
 static Handle<Value> nacl_sign_sync (const Arguments& args) {
@@ -381,8 +1645,7 @@ static Handle<Value> nacl_sign_sync (const Arguments& args) {
 
 static Handle<Value> nacl_sign_open (const Arguments& args) {
     NaclReq *req = new NaclReq();
-    req->init(args, SignOpen, Async);
-    return Undefined();
+    return Boolean::New(req->init(args, SignOpen, Async));
 }
 
 static Handle<Value> nacl_sign_open_sync (const Arguments& args) {
@@ -405,14 +1668,12 @@ static Handle<Value> nacl_sign_keypair (const Arguments& args) {
 
 static Handle<Value> nacl_secretbox (const Arguments& args) {
     NaclReq *req = new NaclReq();
-    req->init(args, SecretBox, Async);
-    return Undefined();
+    return Boolean::New(req->init(args, SecretBox, Async));
 }
 
 static Handle<Value> nacl_secretbox_open (const Arguments& args) {
     NaclReq *req = new NaclReq();
-    req->init(args, SecretBoxOpen, Async);
-    return Undefined();
+    return Boolean::New(req->init(args, SecretBoxOpen, Async));
 }
 
 static Handle<Value> nacl_secretbox_sync (const Arguments& args) {
@@ -429,32 +1690,303 @@ static Handle<Value> nacl_secretbox_open_sync (const Arguments& args) {
     return req.returnVal();
 }
 
+static Handle<Object> hist_to_obj(const NaclHist *h, const NaclHist *base) {
+    HandleScope scope;
+    uint64_t counts[HIST_BUCKETS], total = 0;
+    for(int b = 0; b < HIST_BUCKETS; b++) {
+        counts[b] = h->counts[b] - base->counts[b];
+        total += counts[b];
+    }
+
+    Local<Object> res = Object::New();
+    Local<Array> buckets = Array::New();
+    res->Set(String::NewSymbol("count"), Number::New(total));
+
+    // Percentiles report the upper bound of the bucket they fall in
+    const double pcts[] = { 50, 90, 99, 99.9 };
+    const char *names[] = { "p50", "p90", "p99", "p999" };
+    uint64_t seen = 0;
+    int p = 0, n = 0, last = -1;
+    for(int b = 0; b < HIST_BUCKETS; b++) {
+        if(!counts[b]) {
+            continue;
+        }
+        seen += counts[b];
+        last = b;
+        while(p < 4 && seen >= pcts[p] / 100 * total) {
+            res->Set(String::NewSymbol(names[p++]), Number::New(hist_upper(b)));
+        }
+        Local<Array> bucket = Array::New(2);
+        bucket->Set(0, Number::New(hist_upper(b)));
+        bucket->Set(1, Number::New(counts[b]));
+        buckets->Set(n++, bucket);
+    }
+    res->Set(String::NewSymbol("max"), Number::New(last < 0 ? 0 : hist_upper(last)));
+    res->Set(String::NewSymbol("buckets"), buckets);
+    return scope.Close(res);
+}
+
+/** Counters and latency histograms (nanoseconds) for each request type
+ * since the last stats_reset() */
+static Handle<Value> nacl_stats (const Arguments& args) {
+    HandleScope scope;
+    NaclThreadStats *sum = new NaclThreadStats();
+    stats_sum(sum);
+
+    NaclLoop *home = loop_of(args);
+    Local<Object> res = Object::New();
+    res->Set(String::NewSymbol("in_flight_requests"), Number::New(home->load_requests));
+    res->Set(String::NewSymbol("in_flight_bytes"), Number::New(home->load_bytes));
+    res->Set(String::NewSymbol("queue_depth"),
+        Number::New(__sync_fetch_and_add(&stats_queued, 0)));
+
+    Local<Object> types = Object::New();
+    uv_mutex_lock(&stats_lock);
+    for(int i = 0; i < NACL_REQ_TYPES; i++) {
+        NaclTypeStats *ts = &sum->types[i], *base = &stats_base.types[i];
+        Local<Object> t = Object::New();
+        t->Set(String::NewSymbol("ops"), Number::New(ts->ops - base->ops));
+        t->Set(String::NewSymbol("inline_ops"), Number::New(ts->inline_ops - base->inline_ops));
+        t->Set(String::NewSymbol("bytes_in"), Number::New(ts->bytes_in - base->bytes_in));
+        t->Set(String::NewSymbol("bytes_out"), Number::New(ts->bytes_out - base->bytes_out));
+
+        Local<Object> failures = Object::New();
+        map<string, uint64_t>::iterator it;
+        for(it = stats_failures[i].begin(); it != stats_failures[i].end(); ++it) {
+            failures->Set(String::New(it->first.c_str()), Number::New(it->second));
+        }
+        t->Set(String::NewSymbol("failures"), failures);
+
+        t->Set(String::NewSymbol("queue_wait"), hist_to_obj(&ts->queue_wait, &base->queue_wait));
+        t->Set(String::NewSymbol("exec"), hist_to_obj(&ts->exec, &base->exec));
+        types->Set(String::NewSymbol(req_type_names[i]), t);
+    }
+    uv_mutex_unlock(&stats_lock);
+    res->Set(String::NewSymbol("types"), types);
+
+    delete sum;
+    return scope.Close(res);
+}
+
+static Handle<Value> nacl_stats_reset (const Arguments& args) {
+    NaclThreadStats *sum = new NaclThreadStats();
+    stats_sum(sum);
+    uv_mutex_lock(&stats_lock);
+    memcpy(stats_base.types, sum->types, sizeof(stats_base.types));
+    for(int i = 0; i < NACL_REQ_TYPES; i++) {
+        stats_failures[i].clear();
+    }
+    uv_mutex_unlock(&stats_lock);
+    delete sum;
+    return Undefined();
+}
+
+/** trace_start([capacity], [sample]): start tracing one request in every
+ * 1/sample into a ring of capacity events, dropping earlier events */
+static Handle<Value> nacl_trace_start (const Arguments& args) {
+    uint64_t capacity = TRACE_DEFAULT_CAPACITY;
+    if(args.Length() > 0 && args[0]->IsNumber() && args[0]->IntegerValue() > 0) {
+        capacity = args[0]->IntegerValue();
+    }
+    uint64_t period = 1;
+    if(args.Length() > 1 && args[1]->IsNumber()) {
+        double sample = args[1]->NumberValue();
+        if(!(sample > 0 && sample <= 1)) {
+            return ThrowException(Exception::RangeError(
+                String::New("sample must be in (0, 1]")));
+        }
+        period = (uint64_t)(1 / sample + 0.5);
+    }
+
+    __atomic_store_n(&trace_on, 0, __ATOMIC_RELAXED);
+    // Requests still in flight may write to the old ring, so it is kept
+    // rather than freed; restarting with a new capacity is rare
+    if(!trace_ring || trace_ring->capacity != capacity) {
+        TraceRing *ring = new TraceRing();
+        ring->events = new TraceEvent[capacity];
+        ring->capacity = capacity;
+        trace_ring = ring;
+    }
+    memset(trace_ring->events, 0, capacity * sizeof(TraceEvent));
+    __atomic_store_n(&trace_ring->head, 0, __ATOMIC_RELAXED);
+    trace_period = period;
+    trace_count = 0;
+    trace_start_cycles = cpucycles();
+    trace_start_ns = uv_hrtime();
+    __atomic_store_n(&trace_on, 1, __ATOMIC_RELAXED);
+    return Undefined();
+}
+
+static Handle<Value> nacl_trace_stop (const Arguments& args) {
+    __atomic_store_n(&trace_on, 0, __ATOMIC_RELAXED);
+    return Undefined();
+}
+
+/** Events in the ring as Chrome trace-event JSON (chrome://tracing) */
+static Handle<Value> nacl_trace_export (const Arguments& args) {
+    HandleScope scope;
+    string out = "{\"traceEvents\":[";
+    if(trace_ring) {
+        // cpucycles() to microseconds, calibrated against uv_hrtime()
+        uint64_t cycles = cpucycles() - trace_start_cycles;
+        uint64_t ns = uv_hrtime() - trace_start_ns;
+        double cycles_per_us = ns ? cycles * 1000.0 / ns : 1;
+
+        TraceRing *ring = trace_ring;
+        uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        uint64_t first = head > ring->capacity ? head - ring->capacity : 0;
+        int pid = getpid();
+        bool comma = false;
+        for(uint64_t slot = first; slot < head; slot++) {
+            TraceEvent *e = &ring->events[slot % ring->capacity];
+            uint64_t seq = __atomic_load_n(&e->seq, __ATOMIC_ACQUIRE);
+            uint64_t begin = __atomic_load_n(&e->begin, __ATOMIC_RELAXED);
+            uint64_t end = __atomic_load_n(&e->end, __ATOMIC_RELAXED);
+            uint64_t info = __atomic_load_n(&e->info, __ATOMIC_RELAXED);
+            __atomic_thread_fence(__ATOMIC_ACQUIRE);
+            if(seq != slot + 1 || __atomic_load_n(&e->seq, __ATOMIC_RELAXED) != seq) {
+                continue; // Still being written, or overwritten since
+            }
+
+            char buf[256];
+            snprintf(buf, sizeof(buf), "%s\n{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\","
+                "\"ts\":%.3f,\"dur\":%.3f,\"pid\":%d,\"tid\":%u,\"args\":{\"req\":%u}}",
+                comma ? "," : "",
+                trace_stage_names[info & 0xff],
+                req_type_names[(info >> 8) & 0xff],
+                ((int64_t)(begin - trace_start_cycles)) / cycles_per_us,
+                (end - begin) / cycles_per_us,
+                pid, (unsigned)((info >> 16) & 0xffff), (unsigned)(info >> 32));
+            out += buf;
+            comma = true;
+        }
+    }
+    out += "\n],\"displayTimeUnit\":\"ns\"}\n";
+    return scope.Close(String::New(out.c_str(), out.length()));
+}
+
+/** set_inline_threshold(ns): async requests estimated to take less than
+ * ns run on the calling thread; 0 sends everything to the threadpool */
+static Handle<Value> nacl_set_inline_threshold (const Arguments& args) {
+    if(!args[0]->IsNumber() || args[0]->IntegerValue() < 0) {
+        return ThrowException(Exception::TypeError(
+            String::New("threshold must be a non-negative number")));
+    }
+    inline_threshold = args[0]->IntegerValue();
+    return Undefined();
+}
+
+/** set_coalesce(on): whether requests from one loop iteration are sent to
+ * the threadpool together (the default) or one work item each */
+static Handle<Value> nacl_set_coalesce (const Arguments& args) {
+    coalesce_on = args[0]->BooleanValue();
+    return Undefined();
+}
+
+/** set_limits(max_requests, max_bytes, [ondrain]): cap the async requests
+ * in flight and their total input size; 0 for no limit */
+static Handle<Value> nacl_set_limits (const Arguments& args) {
+    if(!args[0]->IsNumber() || !args[1]->IsNumber()
+            || args[0]->IntegerValue() < 0 || args[1]->IntegerValue() < 0) {
+        return ThrowException(Exception::TypeError(
+            String::New("limits must be non-negative numbers")));
+    }
+    NaclLoop *home = loop_of(args);
+    home->limit_requests = args[0]->IntegerValue();
+    home->limit_bytes = args[1]->IntegerValue();
+    if(!home->drain_cb.IsEmpty()) {
+        home->drain_cb.Dispose();
+        home->drain_cb.Clear();
+    }
+    if(args[2]->IsFunction()) {
+        home->drain_cb = Persistent<Function>::New(Handle<Function>::Cast(args[2]));
+    }
+    return Undefined();
+}
+
+
+static uv_once_t init_once = UV_ONCE_INIT;
+
+// Process-wide setup, once however many instances are created
+static void init_process() {
+    uv_mutex_init(&stats_lock);
+    uv_mutex_init(&sched_lock);
+    const char *threads = getenv("UV_THREADPOOL_SIZE");
+    if(threads && atoi(threads) > 0) {
+        sched_max_runners = atoi(threads) > 1 ? atoi(threads) - 1 : 1;
+    }
+}
+
+static void init_async(NaclLoop *home, uv_async_t *async, uv_async_cb cb) {
+    uv_async_init(home->uv, async, cb);
+    async->data = home;
+    uv_unref((uv_handle_t*)async);
+}
+
+static NaclLoop *loop_new(uv_loop_t *uv) {
+    NaclLoop *home = new NaclLoop();
+    home->uv = uv;
+    home->in_flight = 0;
+    home->limit_requests = home->limit_bytes = 0;
+    home->load_requests = home->load_bytes = 0;
+    home->load_full = false;
+    init_async(home, &home->inline_async, HandleInlineAsync);
+    init_async(home, &home->sched_async, HandleSchedAsync);
+    init_async(home, &home->coalesce_async, HandleCoalesceAsync);
+    return home;
+}
+
+// NODE_SET_METHOD, passing the instance's NaclLoop as the data
+static void set_method(Handle<Object> target, const char *name,
+        InvocationCallback callback, NaclLoop *home) {
+    Local<Function> fn = FunctionTemplate::New(callback,
+        External::New(home))->GetFunction();
+    Local<String> fn_name = String::NewSymbol(name);
+    fn->SetName(fn_name);
+    target->Set(fn_name, fn);
+}
 
 void init (Handle<Object> target) {
     HandleScope scope;
 
-    NODE_SET_METHOD(target, "box", nacl_box);
-    NODE_SET_METHOD(target, "box_open", nacl_box_open);
-    NODE_SET_METHOD(target, "box_sync", nacl_box_sync);
-    NODE_SET_METHOD(target, "box_open_sync", nacl_box_open_sync);
+    uv_once(&init_once, init_process);
+    NaclLoop *home = loop_new(uv_default_loop());
+    key_init(target, home);
+
+    set_method(target, "box", nacl_box, home);
+    set_method(target, "box_open", nacl_box_open, home);
+    set_method(target, "box_sync", nacl_box_sync, home);
+    set_method(target, "box_open_sync", nacl_box_open_sync, home);
+
+    set_method(target, "deflate_box", nacl_deflate_box, home);
+    set_method(target, "inflate_box_open", nacl_inflate_box_open, home);
+    set_method(target, "deflate_box_sync", nacl_deflate_box_sync, home);
+    set_method(target, "inflate_box_open_sync", nacl_inflate_box_open_sync, home);
+    set_method(target, "inflate_box_open_stream", nacl_inflate_box_open_stream, home);
 
-    NODE_SET_METHOD(target, "deflate_box", nacl_deflate_box);
-    NODE_SET_METHOD(target, "inflate_box_open", nacl_inflate_box_open);
-    NODE_SET_METHOD(target, "deflate_box_sync", nacl_deflate_box_sync);
-    NODE_SET_METHOD(target, "inflate_box_open_sync", nacl_inflate_box_open_sync);
+    set_method(target, "box_keypair", nacl_box_keypair, home);
 
-    NODE_SET_METHOD(target, "box_keypair", nacl_box_keypair);
+    set_method(target, "sign", nacl_sign, home);
+    set_method(target, "sign_sync", nacl_sign_sync, home);
+    set_method(target, "sign_open", nacl_sign_open, home);
+    set_method(target, "sign_open_sync", nacl_sign_open_sync, home);
+    set_method(target, "sign_keypair", nacl_sign_keypair, home);
 
-    NODE_SET_METHOD(target, "sign", nacl_sign);
-    NODE_SET_METHOD(target, "sign_sync", nacl_sign_sync);
-    NODE_SET_METHOD(target, "sign_open", nacl_sign_open);
-    NODE_SET_METHOD(target, "sign_open_sync", nacl_sign_open_sync);
-    NODE_SET_METHOD(target, "sign_keypair", nacl_sign_keypair);
+    set_method(target, "secretbox", nacl_secretbox, home);
+    set_method(target, "secretbox_open", nacl_secretbox_open, home);
+    set_method(target, "secretbox_sync", nacl_secretbox_sync, home);
+    set_method(target, "secretbox_open_sync", nacl_secretbox_open_sync, home);
 
-    NODE_SET_METHOD(target, "secretbox", nacl_secretbox);
-    NODE_SET_METHOD(target, "secretbox_open", nacl_secretbox_open);
-    NODE_SET_METHOD(target, "secretbox_sync", nacl_secretbox_sync);
-    NODE_SET_METHOD(target, "secretbox_open_sync", nacl_secretbox_open_sync);
+    set_method(target, "stats", nacl_stats, home);
+    set_method(target, "stats_reset", nacl_stats_reset, home);
+
+    set_method(target, "set_inline_threshold", nacl_set_inline_threshold, home);
+    set_method(target, "set_coalesce", nacl_set_coalesce, home);
+    set_method(target, "set_limits", nacl_set_limits, home);
+
+    set_method(target, "trace_start", nacl_trace_start, home);
+    set_method(target, "trace_stop", nacl_trace_stop, home);
+    set_method(target, "trace_export", nacl_trace_export, home);
 
     target->Set(String::NewSymbol("box_NONCEBYTES"),
         Integer::New(crypto_box_NONCEBYTES));
@@ -468,6 +2000,9 @@ void init (Handle<Object> target) {
     target->Set(String::NewSymbol("sign_SECRETKEYBYTES"),
         Integer::New(crypto_sign_SECRETKEYBYTES));
 
+    target->Set(String::NewSymbol("stream_MAXCHUNKS"),
+        Integer::New(STREAM_MAX_CHUNKS));
+
     target->Set(String::NewSymbol("secretbox_NONCEBYTES"),
         Integer::New(crypto_secretbox_NONCEBYTES));
     target->Set(String::NewSymbol("secretbox_KEYBYTES"),
@@ -13,6 +13,8 @@ extern int crypto_auth(unsigned char *,const unsigned char *,unsigned long long,
 extern int crypto_auth_verify(const unsigned char *,const unsigned char *,unsigned long long,const unsigned char *);
 extern int crypto_secretbox(unsigned char *,const unsigned char *,unsigned long long,const unsigned char *,const unsigned char *);
 extern int crypto_secretbox_open(unsigned char *,const unsigned char *,unsigned long long,const unsigned char *,const unsigned char *);
+extern int crypto_secretbox_multi(unsigned char **,const unsigned char **,const unsigned long long *,const unsigned char **,const unsigned char **,unsigned long long);
+extern int crypto_secretbox_open_multi(unsigned char **,const unsigned char **,const unsigned long long *,const unsigned char **,const unsigned char **,int *,unsigned long long);
 extern int crypto_scalarmult(unsigned char *,const unsigned char *,const unsigned char *);
 extern int crypto_scalarmult_base(unsigned char *,const unsigned char *);
 extern int crypto_box(unsigned char *,const unsigned char *,unsigned long long,const unsigned char *,const unsigned char *,const unsigned char *);
@@ -24,3 +26,7 @@ extern int crypto_box_open_afternm(unsigned char *,const unsigned char *,unsigne
 extern int crypto_sign(unsigned char *,unsigned long long *,const unsigned char *,unsigned long long,const unsigned char *);
 extern int crypto_sign_open(unsigned char *,unsigned long long *,const unsigned char *,unsigned long long,const unsigned char *);
 extern int crypto_sign_keypair(unsigned char *,unsigned char *);
+extern int crypto_sign_expandsk(unsigned char *,const unsigned char *);
+extern int crypto_sign_expandpk(unsigned char *,const unsigned char *);
+extern int crypto_sign_expanded(unsigned char *,unsigned long long *,const unsigned char *,unsigned long long,const unsigned char *);
+extern int crypto_sign_open_expanded(unsigned char *,unsigned long long *,const unsigned char *,unsigned long long,const unsigned char *);
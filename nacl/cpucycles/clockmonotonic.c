@@ -0,0 +1,15 @@
+#include <time.h>
+
+/* nanoseconds, not cycles: a portable stand-in where there is no rdtsc */
+
+long long cpucycles_clockmonotonic(void)
+{
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC,&t);
+  return t.tv_sec * 1000000000LL + t.tv_nsec;
+}
+
+long long cpucycles_clockmonotonic_persecond(void)
+{
+  return 1000000000LL;
+}
@@ -0,0 +1,301 @@
+#include "crypto_core_hsalsa20.h"
+#include "crypto_onetimeauth_poly1305.h"
+#include "crypto_secretbox.h"
+
+/*
+Several independent boxes at once, each with its own key, nonce, length.
+Same results as crypto_secretbox and crypto_secretbox_open on each box.
+The XSalsa20 blocks of LANES boxes are computed side by side,
+one box per vector lane; HSalsa20 and Poly1305 stay per box.
+*/
+
+#ifdef __GNUC__
+
+#include <string.h>
+
+#define LANES 4
+
+typedef unsigned int uint32;
+typedef uint32 lanes __attribute__ ((vector_size (4 * LANES)));
+
+static const unsigned char sigma[16] = "expand 32-byte k";
+static const unsigned char zero[32];
+
+#define ROTATE(v,c) (((v) << (c)) | ((v) >> (32 - (c))))
+
+static uint32 load_littleendian(const unsigned char *x)
+{
+  return
+      (uint32) (x[0]) \
+  | (((uint32) (x[1])) << 8) \
+  | (((uint32) (x[2])) << 16) \
+  | (((uint32) (x[3])) << 24)
+  ;
+}
+
+static void store_littleendian(unsigned char *x,uint32 u)
+{
+  x[0] = u; u >>= 8;
+  x[1] = u; u >>= 8;
+  x[2] = u; u >>= 8;
+  x[3] = u;
+}
+
+/* one box per lane; idle lanes have len 0 */
+struct group {
+  unsigned char *out[LANES];
+  const unsigned char *in[LANES];
+  unsigned long long len[LANES];
+  const unsigned char *n[LANES];
+  const unsigned char *k[LANES];
+  uint32 j[16][LANES]; /* input words; j[w] is loaded as one vector */
+  unsigned char stream[LANES][64];
+} ;
+
+static void group_setup(struct group *g)
+{
+  unsigned char subkey[LANES][32];
+  int l;
+  int w;
+
+  for (l = 0;l < LANES;++l)
+    crypto_core_hsalsa20(subkey[l],g->n[l],g->k[l],sigma);
+  for (w = 0;w < 4;++w)
+    for (l = 0;l < LANES;++l) {
+      g->j[5 * w][l] = load_littleendian(sigma + 4 * w);
+      g->j[1 + w][l] = load_littleendian(subkey[l] + 4 * w);
+      g->j[11 + w][l] = load_littleendian(subkey[l] + 16 + 4 * w);
+    }
+  for (l = 0;l < LANES;++l) {
+    g->j[6][l] = load_littleendian(g->n[l] + 16);
+    g->j[7][l] = load_littleendian(g->n[l] + 20);
+  }
+}
+
+/* stream block b of every lane */
+static void group_block(struct group *g,unsigned long long b)
+{
+  lanes x0, x1, x2, x3, x4, x5, x6, x7, x8, x9, x10, x11, x12, x13, x14, x15;
+  lanes j[16];
+  uint32 out[16][LANES];
+  int i;
+  int w;
+  int l;
+
+  for (l = 0;l < LANES;++l) {
+    g->j[8][l] = b;
+    g->j[9][l] = b >> 32;
+  }
+  memcpy(j,g->j,sizeof j);
+
+  x0 = j[0]; x1 = j[1]; x2 = j[2]; x3 = j[3];
+  x4 = j[4]; x5 = j[5]; x6 = j[6]; x7 = j[7];
+  x8 = j[8]; x9 = j[9]; x10 = j[10]; x11 = j[11];
+  x12 = j[12]; x13 = j[13]; x14 = j[14]; x15 = j[15];
+
+  for (i = 20;i > 0;i -= 2) {
+     x4 ^= ROTATE( x0+x12, 7);
+     x8 ^= ROTATE( x4+ x0, 9);
+    x12 ^= ROTATE( x8+ x4,13);
+     x0 ^= ROTATE(x12+ x8,18);
+     x9 ^= ROTATE( x5+ x1, 7);
+    x13 ^= ROTATE( x9+ x5, 9);
+     x1 ^= ROTATE(x13+ x9,13);
+     x5 ^= ROTATE( x1+x13,18);
+    x14 ^= ROTATE(x10+ x6, 7);
+     x2 ^= ROTATE(x14+x10, 9);
+     x6 ^= ROTATE( x2+x14,13);
+    x10 ^= ROTATE( x6+ x2,18);
+     x3 ^= ROTATE(x15+x11, 7);
+     x7 ^= ROTATE( x3+x15, 9);
+    x11 ^= ROTATE( x7+ x3,13);
+    x15 ^= ROTATE(x11+ x7,18);
+     x1 ^= ROTATE( x0+ x3, 7);
+     x2 ^= ROTATE( x1+ x0, 9);
+     x3 ^= ROTATE( x2+ x1,13);
+     x0 ^= ROTATE( x3+ x2,18);
+     x6 ^= ROTATE( x5+ x4, 7);
+     x7 ^= ROTATE( x6+ x5, 9);
+     x4 ^= ROTATE( x7+ x6,13);
+     x5 ^= ROTATE( x4+ x7,18);
+    x11 ^= ROTATE(x10+ x9, 7);
+     x8 ^= ROTATE(x11+x10, 9);
+     x9 ^= ROTATE( x8+x11,13);
+    x10 ^= ROTATE( x9+ x8,18);
+    x12 ^= ROTATE(x15+x14, 7);
+    x13 ^= ROTATE(x12+x15, 9);
+    x14 ^= ROTATE(x13+x12,13);
+    x15 ^= ROTATE(x14+x13,18);
+  }
+
+  j[0] += x0; j[1] += x1; j[2] += x2; j[3] += x3;
+  j[4] += x4; j[5] += x5; j[6] += x6; j[7] += x7;
+  j[8] += x8; j[9] += x9; j[10] += x10; j[11] += x11;
+  j[12] += x12; j[13] += x13; j[14] += x14; j[15] += x15;
+  memcpy(out,j,sizeof out);
+
+  for (l = 0;l < LANES;++l)
+    for (w = 0;w < 16;++w)
+      store_littleendian(g->stream[l] + 4 * w,out[w][l]);
+}
+
+static void xor64(unsigned char *out,const unsigned char *in,const unsigned char *stream)
+{
+  lanes x[4];
+  lanes y[4];
+  memcpy(x,in,64);
+  memcpy(y,stream,64);
+  x[0] ^= y[0]; x[1] ^= y[1]; x[2] ^= y[2]; x[3] ^= y[3];
+  memcpy(out,x,64);
+}
+
+/* xor every lane with its stream; g->stream already holds block 0 */
+static void group_xor(struct group *g)
+{
+  unsigned long long b;
+  unsigned long long i;
+  unsigned long long end;
+  int more;
+  int l;
+
+  for (b = 0;;) {
+    more = 0;
+    for (l = 0;l < LANES;++l) {
+      if (g->len[l] <= 64 * b) continue;
+      end = g->len[l] - 64 * b;
+      if (end > 64) { end = 64; more = 1; }
+      if (end == 64)
+        xor64(g->out[l] + 64 * b,g->in[l] + 64 * b,g->stream[l]);
+      else
+        for (i = 0;i < end;++i)
+          g->out[l][64 * b + i] = g->in[l][64 * b + i] ^ g->stream[l][i];
+    }
+    if (!more) return;
+    group_block(g,++b);
+  }
+}
+
+static void group_fill(struct group *g,unsigned long long *box,unsigned long long num,
+  unsigned char **out,const unsigned char **in,const unsigned long long *len,
+  const unsigned char **n,const unsigned char **k)
+{
+  int l;
+
+  for (l = 0;l < LANES;++l) {
+    if (*box < num) {
+      g->out[l] = out[*box];
+      g->in[l] = in[*box];
+      g->len[l] = len[*box];
+      g->n[l] = n[*box];
+      g->k[l] = k[*box];
+      ++*box;
+    } else {
+      g->len[l] = 0;
+      g->n[l] = zero;
+      g->k[l] = zero;
+    }
+  }
+}
+
+int crypto_secretbox_multi(
+  unsigned char **c,
+  const unsigned char **m,const unsigned long long *mlen,
+  const unsigned char **n,
+  const unsigned char **k,
+  unsigned long long num
+)
+{
+  struct group g;
+  unsigned long long box;
+  unsigned long long i;
+  int l;
+  int z;
+
+  for (i = 0;i < num;++i) if (mlen[i] < 32) return -1;
+  for (box = 0;box < num;) {
+    i = box;
+    group_fill(&g,&box,num,c,m,mlen,n,k);
+    group_setup(&g);
+    group_block(&g,0);
+    group_xor(&g);
+    for (l = 0;l < LANES && i < box;++l,++i) {
+      crypto_onetimeauth_poly1305(c[i] + 16,c[i] + 32,mlen[i] - 32,c[i]);
+      for (z = 0;z < 16;++z) c[i][z] = 0;
+    }
+  }
+  return 0;
+}
+
+int crypto_secretbox_open_multi(
+  unsigned char **m,
+  const unsigned char **c,const unsigned long long *clen,
+  const unsigned char **n,
+  const unsigned char **k,
+  int *result,
+  unsigned long long num
+)
+{
+  struct group g;
+  unsigned long long box;
+  unsigned long long i;
+  int flagfail = 0;
+  int l;
+  int z;
+
+  for (box = 0;box < num;) {
+    i = box;
+    group_fill(&g,&box,num,m,c,clen,n,k);
+    group_setup(&g);
+    group_block(&g,0);
+    /* verify before writing anything; m may overlap c */
+    for (l = 0;l < LANES && i + l < box;++l) {
+      result[i + l] = -1;
+      if (g.len[l] >= 32)
+        result[i + l] = crypto_onetimeauth_poly1305_verify(g.in[l] + 16,g.in[l] + 32,g.len[l] - 32,g.stream[l]);
+      if (result[i + l]) { result[i + l] = -1; g.len[l] = 0; flagfail = 1; }
+    }
+    group_xor(&g);
+    for (l = 0;l < LANES && i + l < box;++l)
+      if (!result[i + l])
+        for (z = 0;z < 32;++z) m[i + l][z] = 0;
+  }
+  return flagfail ? -1 : 0;
+}
+
+#else
+
+int crypto_secretbox_multi(
+  unsigned char **c,
+  const unsigned char **m,const unsigned long long *mlen,
+  const unsigned char **n,
+  const unsigned char **k,
+  unsigned long long num
+)
+{
+  unsigned long long i;
+
+  for (i = 0;i < num;++i) if (mlen[i] < 32) return -1;
+  for (i = 0;i < num;++i) crypto_secretbox(c[i],m[i],mlen[i],n[i],k[i]);
+  return 0;
+}
+
+int crypto_secretbox_open_multi(
+  unsigned char **m,
+  const unsigned char **c,const unsigned long long *clen,
+  const unsigned char **n,
+  const unsigned char **k,
+  int *result,
+  unsigned long long num
+)
+{
+  unsigned long long i;
+  int flagfail = 0;
+
+  for (i = 0;i < num;++i) {
+    result[i] = crypto_secretbox_open(m[i],c[i],clen[i],n[i],k[i]);
+    if (result[i]) flagfail = 1;
+  }
+  return flagfail ? -1 : 0;
+}
+
+#endif
@@ -6,6 +6,10 @@
 
 #include "ge25519.h"
 
+/* the expanded key layouts below must fit the sizes published in crypto_sign.h */
+typedef char expandedsecretkeybytes_ok[(crypto_sign_EXPANDEDSECRETKEYBYTES == sizeof(sc25519) + 32) ? 1 : -1];
+typedef char expandedpublickeybytes_ok[(crypto_sign_EXPANDEDPUBLICKEYBYTES == sizeof(ge25519)) ? 1 : -1];
+
 int crypto_sign_keypair(
     unsigned char *pk,
     unsigned char *sk
@@ -27,10 +31,42 @@ int crypto_sign_keypair(
   return 0;
 }
 
-int crypto_sign(
+/* esk: sk[0..31] as a reduced scalar, then the nonce prefix sk[32..63] */
+int crypto_sign_expandsk(
+    unsigned char *esk,
+    const unsigned char *sk
+    )
+{
+  sc25519 scsk;
+  unsigned long long i;
+
+  sc25519_from32bytes(&scsk, sk);
+  for(i=0;i<sizeof scsk;i++)
+    esk[i] = ((unsigned char *) &scsk)[i];
+  for(i=0;i<32;i++)
+    esk[sizeof scsk + i] = sk[32+i];
+  return 0;
+}
+
+/* epk: pk decompressed to a curve point; -1 if pk is not on the curve */
+int crypto_sign_expandpk(
+    unsigned char *epk,
+    const unsigned char *pk
+    )
+{
+  ge25519 gepk;
+  unsigned long long i;
+
+  if (ge25519_unpack_vartime(&gepk, pk)) return -1;
+  for(i=0;i<sizeof gepk;i++)
+    epk[i] = ((unsigned char *) &gepk)[i];
+  return 0;
+}
+
+int crypto_sign_expanded(
     unsigned char *sm,unsigned long long *smlen,
     const unsigned char *m,unsigned long long mlen,
-    const unsigned char *sk
+    const unsigned char *esk
     )
 {
   sc25519 sck, scs, scsk;
@@ -41,11 +77,14 @@ int crypto_sign(
   unsigned char hmg[crypto_hash_sha512_BYTES];
   unsigned char hmr[crypto_hash_sha512_BYTES];
 
+  for(i=0;i<sizeof scsk;i++)
+    ((unsigned char *) &scsk)[i] = esk[i];
+
   *smlen = mlen+64;
   for(i=0;i<mlen;i++)
     sm[32 + i] = m[i];
   for(i=0;i<32;i++)
-    sm[i] = sk[32+i];
+    sm[i] = esk[sizeof scsk + i];
   crypto_hash_sha512(hmg, sm, mlen+32); /* Generate k as h(m,sk[32],...,sk[63]) */
 
   sc25519_from64bytes(&sck, hmg);
@@ -59,7 +98,6 @@ int crypto_sign(
   sc25519_from64bytes(&scs, hmr);
   sc25519_mul(&scs, &scs, &sck);
   
-  sc25519_from32bytes(&scsk, sk);
   sc25519_add(&scs, &scs, &scsk);
 
   sc25519_to32bytes(s,&scs); /* cat s */
@@ -69,10 +107,22 @@ int crypto_sign(
   return 0;
 }
 
-int crypto_sign_open(
+int crypto_sign(
+    unsigned char *sm,unsigned long long *smlen,
+    const unsigned char *m,unsigned long long mlen,
+    const unsigned char *sk
+    )
+{
+  unsigned char esk[crypto_sign_EXPANDEDSECRETKEYBYTES];
+
+  crypto_sign_expandsk(esk, sk);
+  return crypto_sign_expanded(sm, smlen, m, mlen, esk);
+}
+
+int crypto_sign_open_expanded(
     unsigned char *m,unsigned long long *mlen,
     const unsigned char *sm,unsigned long long smlen,
-    const unsigned char *pk
+    const unsigned char *epk
     )
 {
   int i;
@@ -82,7 +132,8 @@ int crypto_sign_open(
   unsigned char hmr[crypto_hash_sha512_BYTES];
 
   if (ge25519_unpack_vartime(&get1, sm)) return -1;
-  if (ge25519_unpack_vartime(&gepk, pk)) return -1;
+  for(i=0;i<sizeof gepk;i++)
+    ((unsigned char *) &gepk)[i] = epk[i];
 
   crypto_hash_sha512(hmr,sm,smlen-32);
 
@@ -101,3 +152,15 @@ int crypto_sign_open(
 
   return crypto_verify_32(t1, t2);
 }
+
+int crypto_sign_open(
+    unsigned char *m,unsigned long long *mlen,
+    const unsigned char *sm,unsigned long long smlen,
+    const unsigned char *pk
+    )
+{
+  unsigned char epk[crypto_sign_EXPANDEDPUBLICKEYBYTES];
+
+  if (crypto_sign_expandpk(epk, pk)) return -1;
+  return crypto_sign_open_expanded(m, mlen, sm, smlen, epk);
+}
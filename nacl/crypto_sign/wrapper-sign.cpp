@@ -6,18 +6,16 @@ string crypto_sign(const string &m_string, const string &sk_string)
 {
   if (sk_string.size() != crypto_sign_SECRETKEYBYTES) throw "incorrect secret-key length";
   size_t mlen = m_string.size();
-  unsigned char m[mlen+crypto_sign_BYTES];
+  string sm_string(mlen + crypto_sign_BYTES, 0);
   unsigned long long smlen;
-  for (int i = 0;i < mlen;++i) m[i] = m_string[i];
+  /* not in place: crypto_sign copies m forward to sm + 32 */
   crypto_sign(
-      m, 
+      (unsigned char *) &sm_string[0], 
       &smlen, 
-      m, 
+      (const unsigned char *) m_string.data(), 
       mlen, 
       (const unsigned char *) sk_string.c_str()
       );
-  return string(
-      (char *) m,
-      smlen
-  );
+  sm_string.resize(smlen);
+  return sm_string;
 }
@@ -0,0 +1,487 @@
+#include <signal.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <unistd.h>
+#include <dirent.h>
+#include "e.h"
+#include "die.h"
+#include "byte.h"
+#include "load.h"
+#include "open.h"
+#include "writeall.h"
+#include "nanoseconds.h"
+#include "uint64_pack.h"
+#include "uint64_unpack.h"
+#include "relay.h"
+#include "cpucycles.h"
+
+int flagverbose = 1;
+
+#define USAGE "\
+curvecpbench: how to use:\n\
+curvecpbench:   -q (optional): no error messages\n\
+curvecpbench:   -Q (optional): print error messages (default)\n\
+curvecpbench:   -c n (optional): run n clients at once (default 1)\n\
+curvecpbench:   -n n (optional): each client sends n messages (default 1000)\n\
+curvecpbench:   -s n (optional): each message is n bytes (default 64)\n\
+curvecpbench:   -w n (optional): curvecpmessage window in kilobytes (default 128)\n\
+curvecpbench:   -d ms (optional): relay packets with ms milliseconds delay each way\n\
+curvecpbench:   -l n (optional): relay packets, dropping n out of every 1000\n\
+curvecpbench:   -p port (optional): server's UDP port (default 10500; relay uses port+1)\n\
+curvecpbench:   -e file (optional): serve with curvecpserver -e file, e.g. curvecpecho.so\n\
+curvecpbench: the curvecp programs and curvecpbench itself must be in $PATH\n\
+"
+
+void die_usage(const char *s)
+{
+  if (s) die_4(100,USAGE,"curvecpbench: fatal: ",s,"\n");
+  die_1(100,USAGE);
+}
+
+void die_fatal(const char *trouble,const char *d,const char *fn)
+{
+  if (!flagverbose) die_0(111);
+  if (d) {
+    if (fn) die_9(111,"curvecpbench: fatal: ",trouble," ",d,"/",fn,": ",e_str(errno),"\n");
+    die_7(111,"curvecpbench: fatal: ",trouble," ",d,": ",e_str(errno),"\n");
+  }
+  if (errno) die_5(111,"curvecpbench: fatal: ",trouble,": ",e_str(errno),"\n");
+  die_3(111,"curvecpbench: fatal: ",trouble,"\n");
+}
+
+int numparse(long long *y,const char *x,long long max)
+{
+  long long d;
+  long long j;
+
+  d = 0;
+  for (j = 0;j < 9 && x[j] >= '0' && x[j] <= '9';++j) d = d * 10 + (x[j] - '0');
+  if (j == 0) return 0;
+  if (x[j]) return 0;
+  if (d > max) return 0;
+  *y = d;
+  return 1;
+}
+
+/* output: */
+
+char outbuf[256];
+long long outlen = 0;
+
+void out(const char *s)
+{
+  while (*s && outlen < sizeof outbuf) outbuf[outlen++] = *s++;
+}
+
+/* decimal u >= 0 in s, with terminating 0; returns s */
+char *strnum(char *s,long long u)
+{
+  char x[20];
+  long long len = 0;
+  long long j = 0;
+  do { x[len++] = '0' + (u % 10); u /= 10; } while (u);
+  while (len > 0) s[j++] = x[--len];
+  s[j] = 0;
+  return s;
+}
+
+void outnum(long long u)
+{
+  char x[21];
+  if (u < 0) { out("-"); u = -u; }
+  out(strnum(x,u));
+}
+
+void outline(void)
+{
+  out("\n");
+  if (writeall(1,outbuf,outlen) == -1) die_fatal("unable to write output",0,0);
+  outlen = 0;
+}
+
+/* directory names: */
+
+char dir[] = "/tmp/curvecpbenchXXXXXX";
+char fn[64];
+
+/* dir/name, or dir/name followed by i if i >= 0 */
+char *dirfile(const char *name,long long i)
+{
+  long long j = 0;
+  const char *s;
+
+  for (s = dir;*s;++s) fn[j++] = *s;
+  fn[j++] = '/';
+  for (s = name;*s;++s) fn[j++] = *s;
+  fn[j] = 0;
+  if (i >= 0) strnum(fn + j,i);
+  return fn;
+}
+
+pid_t spawn(char **args)
+{
+  pid_t pid = fork();
+  if (pid == -1) die_fatal("unable to fork",0,0);
+  if (pid == 0) {
+    execvp(*args,args);
+    die_fatal("unable to run",*args,0);
+  }
+  return pid;
+}
+
+long long usage_children(void)
+{
+  struct rusage ru;
+  if (getrusage(RUSAGE_CHILDREN,&ru) == -1) return 0;
+  return ru.ru_utime.tv_sec * 1000000LL + ru.ru_utime.tv_usec
+       + ru.ru_stime.tv_sec * 1000000LL + ru.ru_stime.tv_usec;
+}
+
+/* sums the CPU time recorded by role S; returns number of records */
+long long cpufiles(long long *total)
+{
+  DIR *d;
+  struct dirent *e;
+  unsigned char x[8];
+  long long n = 0;
+
+  *total = 0;
+  d = opendir(dir);
+  if (!d) return 0;
+  while ((e = readdir(d)))
+    if (byte_isequal(e->d_name,3,"cpu"))
+      if (load(dirfile(e->d_name,-1),x,8) == 0) {
+        *total += uint64_unpack(x);
+        ++n;
+      }
+  closedir(d);
+  return n;
+}
+
+/* roles, each started by curvecpbench itself: */
+
+unsigned char buf[65536];
+
+/* E: echo; run by curvecpmessage on the server side */
+int role_echo(void)
+{
+  long long r;
+
+  for (;;) {
+    r = read(0,buf,sizeof buf);
+    if (r == -1) if (errno == EINTR) continue;
+    if (r <= 0) return 0;
+    if (writeall(1,buf,r) == -1) return 111;
+  }
+}
+
+/* S dir window: run by curvecpserver; */
+/* runs curvecpmessage, then records CPU time of it and the echo */
+/* (curvecpserver does not wait for its children, so nobody else can) */
+int role_server(char **argv)
+{
+  char *args[] = { "curvecpmessage", "-w", argv[3], "curvecpbench", "E", 0 };
+  unsigned char x[8];
+  pid_t pid;
+  int status;
+  int fd;
+
+  byte_copy(dir,sizeof dir,argv[2]);
+  pid = spawn(args);
+  while (waitpid(pid,&status,0) == -1) if (errno != EINTR) return 111;
+  uint64_pack(x,usage_children());
+  fd = open_write(dirfile("cpu",getpid()));
+  if (fd == -1) return 111;
+  if (writeall(fd,x,8) == -1) return 111;
+  close(fd);
+  return 0;
+}
+
+/* C dir i n size: run by curvecpmessage -c on the client side */
+/* sends n messages of size bytes one at a time, timing each echo */
+int role_client(char **argv)
+{
+  long long i;
+  long long n;
+  long long size;
+  long long j;
+  long long got;
+  long long r;
+  long long t;
+  unsigned char *result;
+  int fd;
+
+  byte_copy(dir,sizeof dir,argv[2]);
+  if (!numparse(&i,argv[3],1000000)) return 100;
+  if (!numparse(&n,argv[4],100000000)) return 100;
+  if (!numparse(&size,argv[5],sizeof buf)) return 100;
+  result = malloc(8 * (n + 2));
+  if (!result) return 111;
+  byte_zero(buf,size);
+
+  uint64_pack(result,nanoseconds());
+  for (j = 0;j < n;++j) {
+    t = nanoseconds();
+    if (writeall(7,buf,size) == -1) return 111;
+    for (got = 0;got < size;got += r) {
+      r = read(6,buf,size - got);
+      if (r == -1) if (errno == EINTR) { r = 0; continue; }
+      if (r <= 0) return 111;
+    }
+    uint64_pack(result + 16 + 8 * j,nanoseconds() - t);
+  }
+  uint64_pack(result + 8,nanoseconds());
+
+  close(7);
+  while (read(6,buf,sizeof buf) > 0) ;
+
+  fd = open_write(dirfile("client",i));
+  if (fd == -1) return 111;
+  if (writeall(fd,result,8 * (n + 2)) == -1) return 111;
+  close(fd);
+  return 0;
+}
+
+/* main benchmark: */
+
+long long clients = 1;
+long long messages = 1000;
+long long size = 64;
+long long window = 128;
+long long delay = -1;
+long long loss = 0;
+long long port = 10500;
+char *handler = 0; /* shared object echoing in-process, instead of curvecpmessage and E */
+
+int cmp(const void *a,const void *b)
+{
+  long long x = *(const long long *) a;
+  long long y = *(const long long *) b;
+  return x < y ? -1 : x > y;
+}
+
+void sleepms(long long ms)
+{
+  long long until = nanoseconds() + ms * 1000000;
+  while (nanoseconds() < until)
+    if (delay >= 0) relay_step(1); else usleep(1000);
+}
+
+int main(int argc,char **argv)
+{
+  char strwindow[20];
+  char strport[20];
+  char strcport[20];
+  char strclients[20];
+  char stri[20];
+  char strn[20];
+  char strsize[20];
+  char pkhex[65];
+  char keydir[sizeof fn];
+  unsigned char pk[32];
+  unsigned char *result;
+  long long *rtt;
+  long long numrtt = 0;
+  pid_t *client;
+  pid_t server;
+  pid_t pid;
+  int status;
+  long long remaining;
+  long long failed = 0;
+  long long start;
+  long long firststart;
+  long long lastconnect;
+  long long lastend;
+  long long cpu;
+  long long bytes;
+  long long i;
+  long long j;
+
+  signal(SIGPIPE,SIG_IGN);
+
+  if (!argv[0]) die_usage(0);
+  if (argv[1] && argv[1][0] == 'E' && !argv[1][1]) return role_echo();
+  if (argv[1] && argv[1][0] == 'S' && !argv[1][1] && argv[2] && argv[3]) return role_server(argv);
+  if (argv[1] && argv[1][0] == 'C' && !argv[1][1] && argv[2] && argv[3] && argv[4] && argv[5]) return role_client(argv);
+
+  for (;;) {
+    char *x;
+    if (!argv[1]) break;
+    if (argv[1][0] != '-') break;
+    x = *++argv;
+    if (x[0] == '-' && x[1] == 0) break;
+    if (x[0] == '-' && x[1] == '-' && x[2] == 0) break;
+    while (*++x) {
+      long long *y = 0;
+      long long max = 0;
+      if (*x == 'q') { flagverbose = 0; continue; }
+      if (*x == 'Q') { flagverbose = 1; continue; }
+      if (*x == 'e') {
+        if (x[1]) { handler = x + 1; break; }
+        if (!argv[1]) die_usage(0);
+        handler = *++argv;
+        break;
+      }
+      if (*x == 'c') { y = &clients; max = 10000; }
+      if (*x == 'n') { y = &messages; max = 100000000; }
+      if (*x == 's') { y = &size; max = sizeof buf; }
+      if (*x == 'w') { y = &window; max = 65536; }
+      if (*x == 'd') { y = &delay; max = 99999; }
+      if (*x == 'l') { y = &loss; max = 999; }
+      if (*x == 'p') { y = &port; max = 65534; }
+      if (!y) die_usage(0);
+      if (x[1]) { if (!numparse(y,x + 1,max)) die_usage(0); break; }
+      if (!argv[1] || !numparse(y,*++argv,max)) die_usage(0);
+      break;
+    }
+  }
+  if (clients < 1 || size < 1) die_usage("need at least one client and one byte");
+  if (loss && delay < 0) delay = 0;
+  if (delay >= 0 && clients > 1000) die_usage("the relay handles at most 1000 clients");
+
+  if (!mkdtemp(dir)) die_fatal("unable to create temporary directory",0,0);
+  byte_copy(keydir,sizeof fn,dirfile("key",-1));
+  {
+    char *args[] = { "curvecpmakekey", keydir, 0 };
+    pid = spawn(args);
+    if (waitpid(pid,&status,0) == -1 || status) die_fatal("unable to create key",keydir,0);
+  }
+  if (load(dirfile("key/publickey",-1),pk,32) == -1) die_fatal("unable to read",keydir,"publickey");
+  for (i = 0;i < 32;++i) {
+    pkhex[2 * i] = "0123456789abcdef"[pk[i] >> 4];
+    pkhex[2 * i + 1] = "0123456789abcdef"[pk[i] & 15];
+  }
+  pkhex[64] = 0;
+
+  strnum(strwindow,window);
+  strnum(strport,port);
+  strnum(strcport,delay >= 0 ? port + 1 : port);
+  strnum(strclients,clients < 100 ? 100 : clients);
+  strnum(strn,messages);
+  strnum(strsize,size);
+
+  if (handler) {
+    char *args[] = { "curvecpserver", "-e", "-c", strclients, "localhost", keydir,
+      "127.0.0.1", strport, "31415926535897932384626433832795",
+      handler, 0 };
+    server = spawn(args);
+  } else {
+    char *args[] = { "curvecpserver", "-c", strclients, "localhost", keydir,
+      "127.0.0.1", strport, "31415926535897932384626433832795",
+      "curvecpbench", "S", dir, strwindow, 0 };
+    server = spawn(args);
+  }
+
+  if (delay >= 0) {
+    unsigned char ip[4] = {127,0,0,1};
+    unsigned char sport[2];
+    unsigned char cport[2];
+    sport[0] = port >> 8; sport[1] = port;
+    cport[0] = (port + 1) >> 8; cport[1] = port + 1;
+    if (relay_init(ip,cport,ip,sport,delay * 1000000,loss) == -1)
+      die_fatal("unable to create relay",0,0);
+  }
+  sleepms(500); /* let the server bind */
+
+  client = malloc(clients * sizeof(pid_t));
+  rtt = malloc(clients * messages * sizeof(long long));
+  result = malloc(8 * (messages + 2));
+  if (!client || !rtt || !result) die_fatal("unable to allocate memory",0,0);
+
+  start = nanoseconds();
+  for (i = 0;i < clients;++i) {
+    char *args[] = { "curvecpclient", "localhost", pkhex,
+      "127.0.0.1", strcport, "31415926535897932384626433832795",
+      "curvecpmessage", "-c", "-w", strwindow,
+      "curvecpbench", "C", dir, stri, strn, strsize, 0 };
+    strnum(stri,i);
+    client[i] = spawn(args);
+  }
+
+  for (remaining = clients;remaining > 0;) {
+    if (delay >= 0) {
+      relay_step(10);
+      pid = waitpid(-1,&status,WNOHANG);
+    } else
+      pid = waitpid(-1,&status,0);
+    if (pid <= 0) continue;
+    for (i = 0;i < clients;++i)
+      if (client[i] == pid) {
+        client[i] = 0;
+        --remaining;
+        if (status) ++failed;
+      }
+  }
+
+  /* server side finishes once its final acknowledgments are through */
+  cpu = 0;
+  if (handler)
+    sleepms(100); /* all in the server process, counted below */
+  else
+    for (j = 0;j < 1000;++j) {
+      if (cpufiles(&cpu) >= clients) break;
+      sleepms(10);
+    }
+  kill(server,SIGTERM);
+  while (waitpid(server,&status,0) == -1) if (errno != EINTR) break;
+  cpu += usage_children();
+
+  firststart = 0;
+  lastconnect = 0;
+  lastend = 0;
+  for (i = 0;i < clients;++i) {
+    long long t;
+    if (load(dirfile("client",i),result,8 * (messages + 2)) == -1) { ++failed; continue; }
+    t = uint64_unpack(result);
+    if (!firststart || t < firststart) firststart = t;
+    if (t > lastconnect) lastconnect = t;
+    t = uint64_unpack(result + 8);
+    if (t > lastend) lastend = t;
+    for (j = 0;j < messages;++j) rtt[numrtt++] = uint64_unpack(result + 16 + 8 * j);
+  }
+
+  {
+    char *args[] = { "rm", "-rf", dir, 0 };
+    pid = spawn(args);
+    waitpid(pid,&status,0);
+  }
+
+  out("clients "); outnum(clients);
+  out(", messages "); outnum(messages);
+  out(", bytes "); outnum(size);
+  out(", window "); outnum(window); out("KB");
+  if (delay >= 0) { out(", delay "); outnum(delay); out("ms, loss "); outnum(loss); out("/1000"); }
+  if (handler) out(", embedded");
+  outline();
+  if (failed) { out("failed clients: "); outnum(failed); outline(); }
+  if (!numrtt) die_fatal("no client finished",0,0);
+
+  /* handshake: client started until its prog starts, after Hello and Cookie */
+  out("handshakes: "); outnum(clients - failed);
+  out(" in "); outnum((lastconnect - start) / 1000); out("us: ");
+  outnum((clients - failed) * 1000000000LL / (lastconnect - start + 1)); out(" per second");
+  outline();
+
+  bytes = numrtt * size;
+  out("throughput: "); outnum(bytes * 1000000 / ((lastend - firststart) / 1000 + 1)); out(" bytes/s each way");
+  outline();
+
+  qsort(rtt,numrtt,sizeof(long long),cmp);
+  out("rtt: min "); outnum(rtt[0] / 1000);
+  out("us median "); outnum(rtt[numrtt / 2] / 1000);
+  out("us p90 "); outnum(rtt[numrtt * 90 / 100] / 1000);
+  out("us p99 "); outnum(rtt[numrtt * 99 / 100] / 1000);
+  out("us max "); outnum(rtt[numrtt - 1] / 1000); out("us");
+  outline();
+
+  /* all processes on both sides, per byte delivered in either direction */
+  out("cpu: "); outnum(cpu / 1000); out("ms: ");
+  outnum((long long) (cpu * (cpucycles_persecond() / 1000000.0) / (2 * bytes)));
+  out(" cycles per byte");
+  outline();
+
+  return failed ? 111 : 0;
+}
@@ -192,6 +192,34 @@ crypto_uint64 packetnonce;
 int flagreceivedmessage = 0;
 crypto_uint64 receivednonce = 0;
 
+/* batched UDP I/O: */
+#define BATCH 32
+struct socket_packet inbatch[BATCH];
+unsigned char inbuf[BATCH][4096];
+long long innum = 0;
+long long inpos = 0;
+struct socket_packet outbatch[BATCH];
+unsigned char outbuf[BATCH][1184];
+long long outnum = 0;
+
+void packet_flush(void)
+{
+  if (outnum) socket_sendbatch(udpfd,outbatch,outnum);
+  outnum = 0;
+}
+
+void packet_queue(const unsigned char *x,long long xlen,const unsigned char *ip,const unsigned char *port)
+{
+  if (xlen > sizeof outbuf[0]) return;
+  if (outnum == BATCH) packet_flush();
+  outbatch[outnum].x = outbuf[outnum];
+  outbatch[outnum].xlen = xlen;
+  byte_copy(outbuf[outnum],xlen,x);
+  byte_copy(outbatch[outnum].ip,4,ip);
+  byte_copy(outbatch[outnum].port,2,port);
+  ++outnum;
+}
+
 struct pollfd p[3];
 
 int fdwd = -1;
@@ -373,12 +401,23 @@ int main(int argc,char **argv)
       p[1].revents = 0;
     }
 
-    do { /* try receiving a Message packet: */
-      if (!p[0].revents) break;
-      r = socket_recv(udpfd,packet,sizeof packet,packetip,packetport);
+    innum = 0;
+    if (p[0].revents) { /* try receiving a batch of packets: */
+      for (inpos = 0;inpos < BATCH;++inpos) {
+        inbatch[inpos].x = inbuf[inpos];
+        inbatch[inpos].xlen = sizeof inbuf[inpos];
+      }
+      innum = socket_recvbatch(udpfd,inbatch,BATCH);
+    }
+
+    for (inpos = 0;inpos < innum;++inpos) do { /* try handling a Message packet: */
+      r = inbatch[inpos].xlen;
       if (r < 80) break;
       if (r > 1152) break;
       if (r & 15) break;
+      byte_copy(packet,r,inbatch[inpos].x);
+      byte_copy(packetip,4,inbatch[inpos].ip);
+      byte_copy(packetport,2,inbatch[inpos].port);
       packetnonce = uint64_unpack(packet + 40);
       if (flagreceivedmessage && packetnonce <= receivednonce) break;
       if (!(byte_isequal(packetip,4,serverip + 4 * hellopackets) &
@@ -437,7 +476,7 @@ int main(int argc,char **argv)
 	    byte_copy(packet + 40,32,clientshorttermpk);
 	    byte_copy(packet + 72,8,nonce + 16);
 	    byte_copy(packet + 80,r + 16,text + 16);
-            socket_send(udpfd,packet,r + 96,serverip,serverport);
+            packet_queue(packet,r + 96,serverip,serverport);
 	  } else {
 	    r = childmessagelen - 1;
 	    if (r < 16) goto done;
@@ -456,17 +495,21 @@ int main(int argc,char **argv)
 	    byte_copy(packet + 72,96,servercookie);
 	    byte_copy(packet + 168,8,nonce + 16);
 	    byte_copy(packet + 176,r + 368,text + 16);
-            socket_send(udpfd,packet,r + 544,serverip,serverport);
+            packet_queue(packet,r + 544,serverip,serverport);
 	  }
 	  childmessagelen = 0;
 	}
       }
     } while (0);
+
+    packet_flush();
   }
 
 
   done:
 
+  packet_flush();
+
   do {
     r = waitpid(child,&childstatus,0);
   } while (r == -1 && errno == EINTR);
@@ -0,0 +1,107 @@
+#include <signal.h>
+#include <unistd.h>
+#include "e.h"
+#include "die.h"
+#include "portparse.h"
+#include "relay.h"
+
+int flagverbose = 1;
+
+#define USAGE "\
+curvecpdelay: how to use:\n\
+curvecpdelay:   -q (optional): no error messages\n\
+curvecpdelay:   -Q (optional): print error messages (default)\n\
+curvecpdelay:   ip: relay's IP address\n\
+curvecpdelay:   port: relay's UDP port\n\
+curvecpdelay:   serverip: server's IP address\n\
+curvecpdelay:   serverport: server's UDP port\n\
+curvecpdelay:   ms: delay each packet this many milliseconds each way\n\
+"
+
+void die_usage(const char *s)
+{
+  if (s) die_4(100,USAGE,"curvecpdelay: fatal: ",s,"\n");
+  die_1(100,USAGE);
+}
+
+void die_fatal(const char *trouble,const char *d,const char *fn)
+{
+  if (!flagverbose) die_0(111);
+  if (d) {
+    if (fn) die_9(111,"curvecpdelay: fatal: ",trouble," ",d,"/",fn,": ",e_str(errno),"\n");
+    die_7(111,"curvecpdelay: fatal: ",trouble," ",d,": ",e_str(errno),"\n");
+  }
+  if (errno) die_5(111,"curvecpdelay: fatal: ",trouble,": ",e_str(errno),"\n");
+  die_3(111,"curvecpdelay: fatal: ",trouble,"\n");
+}
+
+int ipparse(unsigned char *y,const char *x)
+{
+  long long j;
+  long long k;
+  long long d;
+
+  for (k = 0;k < 4;++k) y[k] = 0;
+  for (k = 0;k < 4;++k) {
+    d = 0;
+    for (j = 0;j < 3 && x[j] >= '0' && x[j] <= '9';++j) d = d * 10 + (x[j] - '0');
+    if (j == 0) return 0;
+    x += j;
+    if (k >= 0 && k < 4) y[k] = d;
+    if (k < 3) {
+      if (*x != '.') return 0;
+      ++x;
+    }
+  }
+  if (*x) return 0;
+  return 1;
+}
+
+int msparse(long long *y,const char *x)
+{
+  long long d;
+  long long j;
+
+  d = 0;
+  for (j = 0;j < 5 && x[j] >= '0' && x[j] <= '9';++j) d = d * 10 + (x[j] - '0');
+  if (j == 0) return 0;
+  if (x[j]) return 0;
+  *y = d * 1000000;
+  return 1;
+}
+
+unsigned char relayip[4];
+unsigned char relayport[2];
+unsigned char serverip[4];
+unsigned char serverport[2];
+long long delay;
+
+int main(int argc,char **argv)
+{
+  signal(SIGPIPE,SIG_IGN);
+
+  if (!argv[0]) die_usage(0);
+  for (;;) {
+    char *x;
+    if (!argv[1]) break;
+    if (argv[1][0] != '-') break;
+    x = *++argv;
+    if (x[0] == '-' && x[1] == 0) break;
+    if (x[0] == '-' && x[1] == '-' && x[2] == 0) break;
+    while (*++x) {
+      if (*x == 'q') { flagverbose = 0; continue; }
+      if (*x == 'Q') { flagverbose = 1; continue; }
+      die_usage(0);
+    }
+  }
+  if (!ipparse(relayip,*++argv)) die_usage("ip must be an IPv4 address");
+  if (!portparse(relayport,*++argv)) die_usage("port must be an integer between 0 and 65535");
+  if (!ipparse(serverip,*++argv)) die_usage("serverip must be an IPv4 address");
+  if (!portparse(serverport,*++argv)) die_usage("serverport must be an integer between 0 and 65535");
+  if (!msparse(&delay,*++argv)) die_usage("ms must be an integer between 0 and 99999");
+
+  if (relay_init(relayip,relayport,serverip,serverport,delay,0) == -1)
+    die_fatal("unable to create relay",0,0);
+
+  for (;;) relay_step(-1);
+}
@@ -0,0 +1,244 @@
+#include <stdlib.h>
+#include <time.h>
+#include "crypto_uint16.h"
+#include "crypto_uint32.h"
+#include "crypto_uint64.h"
+#include "curvecphandler.h"
+
+/*
+Example handler for curvecpserver -e: echoes each client's stream.
+Build: gcc -shared -fPIC -o curvecpecho.so curvecpecho.c
+Use: curvecpserver -e ... curvecpecho.so; client runs curvecpmessage -c.
+
+An embedded handler replaces curvecpmessage as well as prog,
+so it speaks the curvecpmessage protocol itself:
+
+Each message, 48...1088 bytes, multiple of 16:
+  0   4 bytes: message ID; 0 for a pure acknowledgment, never acknowledged
+  4   4 bytes: ID of the message being acknowledged, or 0
+  8   8 bytes: stream bytes 0...n-1 received (n+1 once the eof is in too)
+  16  4 bytes, then 2+2+2+2+2+2+2+2+2 bytes: optional selective ranges:
+      gap, length, gap, length, ... beyond the first range
+  38  2 bytes: D, the data length (at most 1024), plus 2048 for eof
+      or 4096 for eof after an error
+  40  8 bytes: stream position of the data
+  the last D bytes of the message: the data; zeros in between
+
+The receiver acknowledges every message with a nonzero ID,
+with a message of its own or on one carrying data back.
+The sender keeps data until the first range covers it,
+and resends it if no acknowledgment arrives in time.
+The connection is done when both eofs are acknowledged.
+
+This handler keeps it simple: it accepts data only in order, sends no
+selective ranges, sends at most WINDOW unacknowledged bytes, and goes
+back to the first unacknowledged byte after RTO without an acknowledgment,
+doubling RTO up to MAXRTO while nothing gets through. It also goes back
+at once, a single time per loss, when an acknowledgment carries a second
+range: the client holds data beyond a hole.
+*/
+
+#define BUFSIZE 65536 /* power of 2 */
+#define WINDOW 16384
+#define RTO 250000000LL
+#define MAXRTO 8000000000LL
+
+struct echo {
+  struct echo *next;
+  struct echo **prev;
+  long long client;
+  unsigned char buf[BUFSIZE]; /* stream bytes sendacked...received-1, circular */
+  crypto_uint64 received; /* bytes received in order, all to be echoed */
+  crypto_uint16 receivedeof; /* 0, 2048, 4096 once received */
+  crypto_uint64 sendacked; /* echoed bytes acknowledged */
+  crypto_uint64 sent; /* echoed bytes sent, counting from the last go-back */
+  int eofsent;
+  int eofacked;
+  crypto_uint32 nextid;
+  long long lastsend; /* when sendacked last moved, or the first send after */
+  long long rto;
+  int wentback; /* went back since sendacked last moved */
+} ;
+
+static const struct curvecpserverops *server;
+static struct echo *echos = 0;
+
+static long long now(void)
+{
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC,&t);
+  return t.tv_sec * 1000000000LL + t.tv_nsec;
+}
+
+static crypto_uint64 unpack(const unsigned char *x,int len)
+{
+  crypto_uint64 result = 0;
+  while (len > 0) result = (result << 8) | x[--len];
+  return result;
+}
+
+static void pack(unsigned char *y,crypto_uint64 x,int len)
+{
+  int i;
+  for (i = 0;i < len;++i) { y[i] = x; x >>= 8; }
+}
+
+/* one message to the client: D bytes from position pos, or a pure ack if !id */
+static void echo_send(struct echo *e,crypto_uint32 id,crypto_uint32 ackid,crypto_uint16 flags,crypto_uint64 pos,long long D)
+{
+  unsigned char m[1088];
+  long long u;
+  long long i;
+
+  /* same padding as curvecpmessage */
+  u = 64 + D;
+  if (u <= 192) u = 192;
+  else if (u <= 320) u = 320;
+  else if (u <= 576) u = 576;
+  else u = 1088;
+  for (i = 0;i < u;++i) m[i] = 0;
+  pack(m,id,4);
+  pack(m + 4,ackid,4);
+  pack(m + 8,e->received + (e->receivedeof ? 1 : 0),8);
+  pack(m + 38,flags | D,2);
+  pack(m + 40,pos,8);
+  for (i = 0;i < D;++i) m[u - D + i] = e->buf[(pos + i) & (BUFSIZE - 1)];
+  server->reply(e->client,m,u);
+}
+
+static crypto_uint32 newid(struct echo *e)
+{
+  crypto_uint32 id = e->nextid++;
+  if (!e->nextid) e->nextid = 1;
+  return id;
+}
+
+/* sends what is due; returns number of messages */
+static int flush(struct echo *e,crypto_uint32 ackid)
+{
+  long long D;
+  int n = 0;
+
+  while (e->sent < e->received && e->sent - e->sendacked < WINDOW) {
+    D = e->received - e->sent;
+    if (D > 1024) D = 1024;
+    if (e->sent == e->sendacked) e->lastsend = now();
+    echo_send(e,newid(e),ackid,0,e->sent,D);
+    e->sent += D;
+    ++n;
+  }
+  if (e->receivedeof && e->sent == e->received && !e->eofsent) {
+    if (e->sent == e->sendacked) e->lastsend = now();
+    echo_send(e,newid(e),ackid,e->receivedeof,e->sent,0);
+    e->eofsent = 1;
+    ++n;
+  }
+  return n;
+}
+
+static int echo_init(char **argv,const struct curvecpserverops *ops)
+{
+  server = ops;
+  return 0;
+}
+
+static void *echo_open(long long client,const unsigned char *clientlongtermpk,const unsigned char *clientextension)
+{
+  struct echo *e = malloc(sizeof(struct echo));
+  if (!e) return 0;
+  e->client = client;
+  e->received = 0;
+  e->receivedeof = 0;
+  e->sendacked = 0;
+  e->sent = 0;
+  e->eofsent = 0;
+  e->eofacked = 0;
+  e->nextid = 1;
+  e->lastsend = 0;
+  e->rto = RTO;
+  e->wentback = 0;
+  e->next = echos;
+  e->prev = &echos;
+  if (echos) echos->prev = &e->next;
+  echos = e;
+  return e;
+}
+
+static int echo_message(void *conn,const unsigned char *m,long long len)
+{
+  struct echo *e = conn;
+  crypto_uint32 id;
+  crypto_uint64 acked;
+  crypto_uint64 start;
+  crypto_uint64 stop;
+  crypto_uint16 SF;
+  long long D;
+
+  if (len < 48) return 0;
+  id = unpack(m,4);
+
+  /* acknowledgments of echoed bytes, and of the eof just past them */
+  acked = unpack(m + 8,8);
+  if (e->eofsent && acked == e->received + 1 && e->sent == e->received) {
+    e->eofacked = 1;
+    acked = e->received;
+  }
+  if (acked > e->sendacked && acked <= e->received) {
+    e->sendacked = acked;
+    if (e->sent < acked) e->sent = acked; /* acknowledged from before a go-back */
+    e->lastsend = now();
+    e->rto = RTO;
+    e->wentback = 0;
+  }
+  if (e->sent > e->sendacked && !e->wentback && unpack(m + 20,2)) {
+    e->sent = e->sendacked;
+    e->wentback = 1;
+  }
+
+  /* data, taken only where it continues the stream and fits the buffer */
+  D = unpack(m + 38,2);
+  SF = D & (2048 + 4096);
+  D -= SF;
+  if (D <= 1024 && 48 + D <= len && !e->receivedeof) {
+    start = unpack(m + 40,8);
+    stop = start + D;
+    if (start <= e->received && stop >= e->received && stop <= e->sendacked + BUFSIZE) {
+      while (e->received < stop) {
+        e->buf[e->received & (BUFSIZE - 1)] = m[len - D + (e->received - start)];
+        ++e->received;
+      }
+      if (SF) e->receivedeof = SF;
+    }
+  }
+
+  if (!flush(e,id) && id) echo_send(e,0,id,0,0,0);
+  if (e->eofacked && e->receivedeof) return -1;
+  return 0;
+}
+
+static void echo_close(void *conn)
+{
+  struct echo *e = conn;
+  *e->prev = e->next;
+  if (e->next) e->next->prev = e->prev;
+  free(e);
+}
+
+/* go back to the first unacknowledged byte after rto */
+static void echo_tick(void)
+{
+  struct echo *e;
+  long long t = now();
+
+  for (e = echos;e;e = e->next) {
+    if (e->sent == e->sendacked && (!e->eofsent || e->eofacked)) continue;
+    if (t - e->lastsend < e->rto) continue;
+    e->sent = e->sendacked;
+    e->eofsent = 0;
+    if (e->rto < MAXRTO) e->rto *= 2;
+    flush(e,0);
+    e->lastsend = t;
+  }
+}
+
+struct curvecphandler curvecphandler = { echo_init, echo_open, echo_message, echo_close, echo_tick };
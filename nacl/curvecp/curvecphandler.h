@@ -0,0 +1,44 @@
+#ifndef CURVECPHANDLER_H
+#define CURVECPHANDLER_H
+
+/*
+Embedded handler for curvecpserver -e.
+The handler is a shared object exporting "curvecphandler".
+Messages are what a forked prog would read on descriptor 8 and write on
+descriptor 9, without the length byte: 16...1088 bytes, multiple of 16.
+That is, the handler stands in for curvecpmessage as well as its prog,
+and has to do curvecpmessage's work itself: stream positions,
+acknowledgments, retransmission, eof. curvecpecho.c describes the
+message layout and is a minimal working handler (curvecpbench -e).
+
+init: called once at startup, before -t workers are forked, with the args
+  after the object name and the server's functions; returns -1 to abort.
+open: a new client has authenticated; client identifies it to the server
+  until close; returns a connection pointer, or 0 to refuse the client.
+message: a message from the client; returns -1 to end the connection.
+close: the connection is gone, by end, by -1 from message, or because the
+  client sent nothing for the idle timeout (curvecpserver -i);
+  conn and client are not used again.
+tick (optional): called on every pass through the server's event loop,
+  at least every 100ms; the place for replies that are not answers.
+
+Server functions, for use from message, tick and close:
+reply(client,m,mlen) queues a message to client; -1 if client is gone
+  or mlen is not 16...1088 and a multiple of 16.
+end(client) ends the connection once the current call returns.
+*/
+
+struct curvecpserverops {
+  int (*reply)(long long client,const unsigned char *m,long long mlen);
+  void (*end)(long long client);
+} ;
+
+struct curvecphandler {
+  int (*init)(char **,const struct curvecpserverops *);
+  void *(*open)(long long client,const unsigned char *clientlongtermpk,const unsigned char *clientextension);
+  int (*message)(void *conn,const unsigned char *m,long long mlen);
+  void (*close)(void *conn);
+  void (*tick)(void);
+} ;
+
+#endif
@@ -3,6 +3,10 @@
 #include <unistd.h>
 #include <signal.h>
 #include <poll.h>
+#include <stdlib.h>
+#ifdef __linux__
+#include <sys/timerfd.h>
+#endif
 #include "open.h"
 #include "blocking.h"
 #include "e.h"
@@ -10,6 +14,7 @@
 #include "randommod.h"
 #include "byte.h"
 #include "crypto_uint32.h"
+#include "crypto_uint64.h"
 #include "uint16_pack.h"
 #include "uint32_pack.h"
 #include "uint64_pack.h"
@@ -22,6 +27,8 @@
 int flagverbose = 1;
 int flagserver = 1;
 int wantping = 0; /* 1: ping after a second; 2: ping immediately */
+int flagpooled = 0; /* started ahead of its client by curvecpserver -p */
+int flagheard = 0; /* a message has arrived; until then a pooled server sends nothing */
 
 #define USAGE "\
 curvecpmessage: how to use:\n\
@@ -31,9 +38,25 @@ curvecpmessage:   -v (optional): print extra information\n\
 curvecpmessage:   -c (optional): program is a client; server starts first\n\
 curvecpmessage:   -C (optional): program is a client that starts first\n\
 curvecpmessage:   -s (optional): program is a server (default)\n\
+curvecpmessage:   -w n (optional): buffer n kilobytes each way (default 128; power of 2 up to 65536; use the same n on both sides)\n\
 curvecpmessage:   prog: run this program\n\
 "
 
+int windowparse(long long *y,const char *x)
+{
+  long long d;
+  long long j;
+
+  d = 0;
+  for (j = 0;j < 9 && x[j] >= '0' && x[j] <= '9';++j) d = d * 10 + (x[j] - '0');
+  if (x[j]) return 0;
+  if (d < 128) return 0;
+  if (d > 65536) return 0;
+  if (d & (d - 1)) return 0;
+  *y = d;
+  return 1;
+}
+
 void die_usage(const char *s)
 {
   if (s) die_4(100,USAGE,"curvecpmessage: fatal: ",s,"\n");
@@ -69,11 +92,15 @@ int fromchild[2] = {-1,-1};
 pid_t child = -1;
 int childstatus;
 
-struct pollfd p[3];
+struct pollfd p[4];
 
 long long sendacked = 0; /* number of initial bytes sent and fully acknowledged */
 long long sendbytes = 0; /* number of additional bytes to send */
-unsigned char sendbuf[131072]; /* circular queue with the additional bytes; size must be power of 2 */
+const char *strwindow = "128";
+long long window = 0; /* kilobytes; power of 2 */
+
+long long sendbufsize;
+unsigned char *sendbuf; /* circular queue with the additional bytes; size must be power of 2 */
 long long sendprocessed = 0; /* within sendbytes, number of bytes absorbed into blocks */
 
 crypto_uint16 sendeof = 0; /* 2048 for normal eof after sendbytes, 4096 for error after sendbytes */
@@ -83,22 +110,26 @@ int sendeofacked = 0;
 long long totalblocktransmissions = 0;
 long long totalblocks = 0;
 
-#define OUTGOING 128 /* must be power of 2 */
+long long outgoing; /* window, one block per kilobyte; power of 2 */
 long long blocknum = 0; /* number of outgoing blocks being tracked */
 long long blockfirst = 0; /* circular queue */
-long long blockpos[OUTGOING]; /* position of block's first byte within stream */
-long long blocklen[OUTGOING]; /* number of bytes in this block */
-crypto_uint16 blockeof[OUTGOING]; /* 0, 2048, 4096 */
-long long blocktransmissions[OUTGOING];
-long long blocktime[OUTGOING]; /* time of last message sending this block; 0 means acked */
+long long *blockpos; /* position of block's first byte within stream */
+long long *blocklen; /* number of bytes in this block */
+crypto_uint16 *blockeof; /* 0, 2048, 4096 */
+long long *blocktransmissions;
+long long *blocktime; /* time of last message sending this block; 0 means acked */
 long long earliestblocktime = 0; /* if nonzero, minimum of active blocktime values */
-crypto_uint32 blockid[OUTGOING]; /* ID of last message sending this block */
+crypto_uint32 *blockid; /* ID of last message sending this block */
+long long *blockidpos; /* 4 * outgoing entries: position of block last sent with this ID, or -1 */
+long long *blockheap; /* positions of blocks with nonzero blocktime; min-heap on blocktime */
+long long blockheapnum = 0;
+long long *blockheapindex; /* index of block within blockheap; -1 if not there */
 
-#define INCOMING 64 /* must be power of 2 */
+long long incoming; /* power of 2 */
 long long messagenum = 0; /* number of messages in incoming queue */
 long long messagefirst = 0; /* position of first message; circular queue */
-unsigned char messagelen[INCOMING]; /* times 16 */
-unsigned char message[INCOMING][1088];
+unsigned char *messagelen; /* times 16 */
+unsigned char (*message)[1088];
 unsigned char messagetodo[2048];
 long long messagetodolen = 0;
 
@@ -106,8 +137,10 @@ long long receivebytes = 0; /* number of initial bytes fully received */
 long long receivewritten = 0; /* within receivebytes, number of bytes given to child */
 crypto_uint16 receiveeof = 0; /* 0, 2048, 4096 */
 long long receivetotalbytes = 0; /* total number of bytes in stream, if receiveeof */
-unsigned char receivebuf[131072]; /* circular queue beyond receivewritten; size must be power of 2 */
-unsigned char receivevalid[131072]; /* 1 for byte successfully received; XXX: use buddy structure to speed this up */
+long long receivehighest = 0; /* end of highest block received */
+long long receivebufsize;
+unsigned char *receivebuf; /* circular queue beyond receivewritten; size must be power of 2 */
+crypto_uint64 *receivevalid; /* bit set for byte successfully received, parallel to receivebuf */
 
 long long maxblocklen = 512;
 crypto_uint32 nextmessageid = 1;
@@ -135,38 +168,169 @@ long long rtt_phase = 0;
 
 long long lastpanic = 0;
 
-void earliestblocktime_compute(void) /* XXX: use priority queue */
+/* pacing: */
+/* lastblocktime advances by nsecperblock for each block sent */
+/* blocks due within PACINGSLACK go out in the same wakeup, */
+/* so the rate holds even when nsecperblock is below timer resolution */
+#define PACINGSLACK 50000
+
+#ifdef TFD_TIMER_ABSTIME
+
+/* poll() sleeps in milliseconds; a timerfd wakes up within microseconds */
+int timer = -1;
+
+void pacing_init(void)
 {
-  long long i;
+  timer = timerfd_create(CLOCK_MONOTONIC,TFD_NONBLOCK | TFD_CLOEXEC);
+}
+
+/* returns poll timeout; adds timer to q if it is used */
+long long pacing_arm(struct pollfd **q,long long nsec)
+{
+  struct itimerspec t;
+
+  if (nsec <= 0) return 0;
+  if (timer == -1) return nsec / 1000000 + 1;
+  byte_zero(&t,sizeof t);
+  t.it_value.tv_sec = nsec / 1000000000;
+  t.it_value.tv_nsec = nsec % 1000000000;
+  if (timerfd_settime(timer,0,&t,0) == -1) return nsec / 1000000 + 1;
+  (*q)->fd = timer; (*q)->events = POLLIN; ++*q;
+  return -1;
+}
+
+void pacing_clear(void)
+{
+  crypto_uint64 expirations;
+  if (timer != -1) read(timer,&expirations,sizeof expirations);
+}
+
+#else
+
+void pacing_init(void) { }
+long long pacing_arm(struct pollfd **q,long long nsec) { return nsec <= 0 ? 0 : nsec / 1000000 + 1; }
+void pacing_clear(void) { }
+
+#endif
+
+void receivevalid_mark(long long pos,long long len,int flag)
+{
+  /* bits for receivebuf positions pos...pos+len-1; no wraparound */
+  crypto_uint64 mask;
+  long long n;
+
+  while (len > 0) {
+    n = 64 - (pos & 63);
+    if (n > len) n = len;
+    mask = ~(crypto_uint64) 0;
+    if (n < 64) mask = ((((crypto_uint64) 1) << n) - 1) << (pos & 63);
+    if (flag) receivevalid[pos / 64] |= mask;
+    else receivevalid[pos / 64] &= ~mask;
+    pos += n;
+    len -= n;
+  }
+}
+
+long long receivevalid_scan(long long x,long long limit,int flag)
+{
+  /* first stream position in x...limit-1 whose bit is not flag; or limit */
+  crypto_uint64 w;
   long long pos;
-  earliestblocktime = 0;
-  for (i = 0;i < blocknum;++i) {
-    pos = (blockfirst + i) & (OUTGOING - 1);
-    if (blocktime[pos]) {
-      if (!earliestblocktime)
-        earliestblocktime = blocktime[pos];
-      else
-        if (blocktime[pos] < earliestblocktime)
-	  earliestblocktime = blocktime[pos];
-    }
+  long long n;
+
+  while (x < limit) {
+    pos = x & (receivebufsize - 1);
+    w = receivevalid[pos / 64];
+    if (!flag) w = ~w;
+    w >>= pos & 63;
+    n = 0;
+    if (!(pos & 63) && w == ~(crypto_uint64) 0)
+      n = 64;
+    else
+      while (n < 64 - (pos & 63) && (w & 1)) { w >>= 1; ++n; }
+    if (n > limit - x) n = limit - x;
+    x += n;
+    if (n < 64 - (pos & 63)) break;
+  }
+  return x;
+}
+
+void blockheap_place(long long h,long long pos)
+{
+  blockheap[h] = pos;
+  blockheapindex[pos] = h;
+}
+
+void blockheap_sift(long long h)
+{
+  long long pos = blockheap[h];
+  long long c;
+
+  while (h > 0) {
+    c = (h - 1) / 2;
+    if (blocktime[blockheap[c]] <= blocktime[pos]) break;
+    blockheap_place(h,blockheap[c]);
+    h = c;
+  }
+  for (;;) {
+    c = 2 * h + 1;
+    if (c >= blockheapnum) break;
+    if (c + 1 < blockheapnum)
+      if (blocktime[blockheap[c + 1]] < blocktime[blockheap[c]]) ++c;
+    if (blocktime[blockheap[c]] >= blocktime[pos]) break;
+    blockheap_place(h,blockheap[c]);
+    h = c;
   }
+  blockheap_place(h,pos);
+}
+
+void blockheap_update(long long pos) /* blocktime[pos] has a new nonzero value */
+{
+  if (blockheapindex[pos] < 0) blockheap_place(blockheapnum++,pos);
+  blockheap_sift(blockheapindex[pos]);
+}
+
+void blockheap_remove(long long pos)
+{
+  long long h = blockheapindex[pos];
+  if (h < 0) return;
+  blockheapindex[pos] = -1;
+  if (h == --blockheapnum) return;
+  blockheap_place(h,blockheap[blockheapnum]);
+  blockheap_sift(h);
+}
+
+void earliestblocktime_compute(void)
+{
+  earliestblocktime = 0;
+  if (blockheapnum) earliestblocktime = blocktime[blockheap[0]];
 }
 
 void acknowledged(unsigned long long start,unsigned long long stop)
 {
   long long i;
+  long long j;
   long long pos;
   if (stop == start) return;
-  for (i = 0;i < blocknum;++i) {
-    pos = (blockfirst + i) & (OUTGOING - 1);
-    if (blockpos[pos] >= start && blockpos[pos] + blocklen[pos] <= stop) {
+  /* blocks are in stream order; find the first one at or after start */
+  i = 0;
+  j = blocknum;
+  while (i < j) {
+    pos = (blockfirst + (i + j) / 2) & (outgoing - 1);
+    if (blockpos[pos] < start) i = (i + j) / 2 + 1; else j = (i + j) / 2;
+  }
+  for (;i < blocknum;++i) {
+    pos = (blockfirst + i) & (outgoing - 1);
+    if (blockpos[pos] + blocklen[pos] > stop) break;
+    if (blocktime[pos]) {
       blocktime[pos] = 0;
+      blockheap_remove(pos);
       totalblocktransmissions += blocktransmissions[pos];
       totalblocks += 1;
     }
   }
   while (blocknum) {
-    pos = blockfirst & (OUTGOING - 1);
+    pos = blockfirst & (outgoing - 1);
     if (blocktime[pos]) break;
     sendacked += blocklen[pos];
     sendbytes -= blocklen[pos];
@@ -216,11 +380,19 @@ int main(int argc,char **argv)
       if (*x == 'c') { flagserver = 0; wantping = 2; continue; }
       if (*x == 'C') { flagserver = 0; wantping = 1; continue; }
       if (*x == 's') { flagserver = 1; wantping = 0; continue; }
+      if (*x == 'w') {
+        if (x[1]) { strwindow = x + 1; break; }
+	if (argv[1]) { strwindow = *++argv; break; }
+      }
       die_usage(0);
     }
   }
+  if (!windowparse(&window,strwindow)) die_usage("window must be a power of 2 between 128 and 65536");
   if (!*++argv) die_usage("missing prog");
 
+  if (flagserver && getenv("CURVECPPOOLED")) flagpooled = 1;
+  unsetenv("CURVECPPOOLED");
+
   for (;;) {
     r = open_read("/dev/null");
     if (r == -1) die_fatal("unable to open /dev/null",0,0);
@@ -257,6 +429,33 @@ int main(int argc,char **argv)
   close(tochild[0]);
   close(fromchild[1]);
 
+  sendbufsize = window * 1024;
+  receivebufsize = window * 1024;
+  outgoing = window;
+  incoming = window / 2;
+  sendbuf = malloc(sendbufsize);
+  receivebuf = malloc(receivebufsize);
+  receivevalid = calloc(receivebufsize / 64,sizeof(crypto_uint64));
+  blockpos = malloc(outgoing * sizeof(long long));
+  blocklen = malloc(outgoing * sizeof(long long));
+  blockeof = malloc(outgoing * sizeof(crypto_uint16));
+  blocktransmissions = malloc(outgoing * sizeof(long long));
+  blocktime = malloc(outgoing * sizeof(long long));
+  blockid = malloc(outgoing * sizeof(crypto_uint32));
+  blockidpos = malloc(4 * outgoing * sizeof(long long));
+  blockheap = malloc(outgoing * sizeof(long long));
+  blockheapindex = malloc(outgoing * sizeof(long long));
+  messagelen = malloc(incoming);
+  message = malloc(incoming * sizeof(*message));
+  if (!sendbuf || !receivebuf || !receivevalid || !blockpos || !blocklen || !blockeof
+   || !blocktransmissions || !blocktime || !blockid || !blockidpos || !blockheap || !blockheapindex
+   || !messagelen || !message)
+    die_fatal("unable to allocate buffers",0,0);
+  for (i = 0;i < outgoing;++i) blockheapindex[i] = -1;
+  for (i = 0;i < 4 * outgoing;++i) blockidpos[i] = -1;
+
+  pacing_init();
+
   recent = nanoseconds();
   lastspeedadjustment = recent;
   if (flagserver) maxblocklen = 1024;
@@ -280,35 +479,42 @@ int main(int argc,char **argv)
 
     watchfromchild = q;
     if (sendeof) watchfromchild = 0;
-    if (sendbytes + 4096 > sizeof sendbuf) watchfromchild = 0;
+    if (sendbytes + 4096 > sendbufsize) watchfromchild = 0;
     if (watchfromchild) { q->fd = fromchild[0]; q->events = POLLIN; ++q; }
 
     nextaction = recent + 60000000000LL;
     if (wantping == 1) nextaction = recent + 1000000000;
     if (wantping == 2)
       if (nextaction > lastblocktime + nsecperblock) nextaction = lastblocktime + nsecperblock;
-    if (blocknum < OUTGOING)
-      if (!(sendeof ? sendeofprocessed : sendprocessed >= sendbytes))
-        if (nextaction > lastblocktime + nsecperblock) nextaction = lastblocktime + nsecperblock;
-    if (earliestblocktime)
-      if (earliestblocktime + rtt_timeout > lastblocktime + nsecperblock)
+    if (blocknum < outgoing)
+      if (!flagpooled || flagheard)
+        if (!(sendeof ? sendeofprocessed : sendprocessed >= sendbytes))
+          if (nextaction > lastblocktime + nsecperblock) nextaction = lastblocktime + nsecperblock;
+    if (earliestblocktime) {
+      /* resend when both rtt_timeout and pacing allow, even if nothing arrives */
+      if (earliestblocktime + rtt_timeout > lastblocktime + nsecperblock) {
         if (earliestblocktime + rtt_timeout < nextaction)
 	  nextaction = earliestblocktime + rtt_timeout;
+      } else
+        if (lastblocktime + nsecperblock < nextaction)
+	  nextaction = lastblocktime + nsecperblock;
+    }
 
     if (messagenum)
       if (!watchtochild)
         nextaction = 0;
 
-    if (nextaction <= recent)
+    if (nextaction <= recent + PACINGSLACK)
       timeout = 0;
     else
-      timeout = (nextaction - recent) / 1000000 + 1;
+      timeout = pacing_arm(&q,nextaction - recent);
 
     if (poll(p,q - p,timeout) < 0) {
       watch8 = 0;
       watchtochild = 0;
       watchfromchild = 0;
     } else {
+      if (timeout == -1) if (q[-1].revents) pacing_clear();
       if (watch8) if (!watch8->revents) watch8 = 0;
       if (watchtochild) if (!watchtochild->revents) watchtochild = 0;
       if (watchfromchild) if (!watchfromchild->revents) watchfromchild = 0;
@@ -319,13 +525,13 @@ int main(int argc,char **argv)
     do { /* try receiving data from child: */
       if (!watchfromchild) break;
       if (sendeof) break;
-      if (sendbytes + 4096 > sizeof sendbuf) break;
+      if (sendbytes + 4096 > sendbufsize) break;
 
-      pos = (sendacked & (sizeof sendbuf - 1)) + sendbytes;
-      if (pos < sizeof sendbuf) {
-        r = read(fromchild[0],sendbuf + pos,sizeof sendbuf - pos);
+      pos = (sendacked & (sendbufsize - 1)) + sendbytes;
+      if (pos < sendbufsize) {
+        r = read(fromchild[0],sendbuf + pos,sendbufsize - pos);
       } else {
-        r = read(fromchild[0],sendbuf + pos - sizeof sendbuf,sizeof sendbuf - sendbytes);
+        r = read(fromchild[0],sendbuf + pos - sendbufsize,sendbufsize - sendbytes);
       }
       if (r == -1) if (errno == EINTR || errno == EWOULDBLOCK || errno == EAGAIN) break;
       if (r < 0) { sendeof = 4096; break; }
@@ -337,37 +543,34 @@ int main(int argc,char **argv)
     recent = nanoseconds();
 
     do { /* try re-sending an old block: */
-      if (recent < lastblocktime + nsecperblock) break;
+      if (recent + PACINGSLACK < lastblocktime + nsecperblock) break;
       if (earliestblocktime == 0) break;
-      if (recent < earliestblocktime + rtt_timeout) break;
-
-      for (i = 0;i < blocknum;++i) {
-	pos = (blockfirst + i) & (OUTGOING - 1);
-        if (blocktime[pos] == earliestblocktime) {
-	  if (recent > lastpanic + 4 * rtt_timeout) {
-	    nsecperblock *= 2;
-	    lastpanic = recent;
-	    lastedge = recent;
-	  }
-	  goto sendblock;
-        }
+      if (recent + PACINGSLACK < earliestblocktime + rtt_timeout) break;
+
+      pos = blockheap[0];
+      if (recent > lastpanic + 4 * rtt_timeout) {
+        nsecperblock *= 2;
+        lastpanic = recent;
+        lastedge = recent;
       }
+      goto sendblock;
     } while(0);
 
     do { /* try sending a new block: */
-      if (recent < lastblocktime + nsecperblock) break;
-      if (blocknum >= OUTGOING) break;
+      if (recent + PACINGSLACK < lastblocktime + nsecperblock) break;
+      if (blocknum >= outgoing) break;
+      if (flagpooled && !flagheard) break; /* prog started before the client */
       if (!wantping)
         if (sendeof ? sendeofprocessed : sendprocessed >= sendbytes) break;
       /* XXX: if any Nagle-type processing is desired, do it here */
 
-      pos = (blockfirst + blocknum) & (OUTGOING - 1);
+      pos = (blockfirst + blocknum) & (outgoing - 1);
       ++blocknum;
       blockpos[pos] = sendacked + sendprocessed;
       blocklen[pos] = sendbytes - sendprocessed;
       if (blocklen[pos] > maxblocklen) blocklen[pos] = maxblocklen;
-      if ((blockpos[pos] & (sizeof sendbuf - 1)) + blocklen[pos] > sizeof sendbuf)
-        blocklen[pos] = sizeof sendbuf - (blockpos[pos] & (sizeof sendbuf - 1));
+      if ((blockpos[pos] & (sendbufsize - 1)) + blocklen[pos] > sendbufsize)
+        blocklen[pos] = sendbufsize - (blockpos[pos] & (sendbufsize - 1));
 	/* XXX: or could have the full block in post-buffer space */
       sendprocessed += blocklen[pos];
       blockeof[pos] = 0;
@@ -381,7 +584,9 @@ int main(int argc,char **argv)
 
       blocktransmissions[pos] += 1;
       blocktime[pos] = recent;
+      blockheap_update(pos);
       blockid[pos] = nextmessageid;
+      blockidpos[nextmessageid & (4 * outgoing - 1)] = pos;
       if (!++nextmessageid) ++nextmessageid;
 
       /* constraints: u multiple of 16; u >= 16; u <= 1088; u >= 48 + blocklen[pos] */
@@ -399,10 +604,11 @@ int main(int argc,char **argv)
       /* XXX: include any acknowledgments that have piled up */
       uint16_pack(buf + 46,blockeof[pos] | (crypto_uint16) blocklen[pos]);
       uint64_pack(buf + 48,blockpos[pos]);
-      byte_copy(buf + 8 + u - blocklen[pos],blocklen[pos],sendbuf + (blockpos[pos] & (sizeof sendbuf - 1)));
+      byte_copy(buf + 8 + u - blocklen[pos],blocklen[pos],sendbuf + (blockpos[pos] & (sendbufsize - 1)));
 
       if (writeall(9,buf + 7,u + 1) == -1) die_fatal("unable to write descriptor 9",0,0);
-      lastblocktime = recent;
+      lastblocktime += nsecperblock;
+      if (lastblocktime < recent - PACINGSLACK) lastblocktime = recent - PACINGSLACK;
       wantping = 0;
 
       earliestblocktime_compute();
@@ -420,8 +626,8 @@ int main(int argc,char **argv)
 	if (u < 16) die_badmessage();
 	if (u > 1088) die_badmessage();
 	if (messagetodolen == 1 + u) {
-	  if (messagenum < INCOMING) {
-	    pos = (messagefirst + messagenum) & (INCOMING - 1);
+	  if (messagenum < incoming) {
+	    pos = (messagefirst + messagenum) & (incoming - 1);
 	    messagelen[pos] = messagetodo[0];
 	    byte_copy(message[pos],u,messagetodo + 1);
 	    ++messagenum;
@@ -438,8 +644,9 @@ int main(int argc,char **argv)
       if (tochild[1] >= 0 && receivewritten < receivebytes) break;
 
       maxblocklen = 1024;
+      flagheard = 1;
 
-      pos = messagefirst & (INCOMING - 1);
+      pos = messagefirst & (incoming - 1);
       len = 16 * (unsigned long long) messagelen[pos];
       do { /* handle this message if it's comprehensible: */
 	unsigned long long D;
@@ -453,9 +660,9 @@ int main(int argc,char **argv)
         if (len > 1088) break;
 
 	id = uint32_unpack(message[pos] + 4);
-	for (i = 0;i < blocknum;++i) {
-	  k = (blockfirst + i) & (OUTGOING - 1);
-	  if (blockid[k] == id) {
+	k = blockidpos[id & (4 * outgoing - 1)];
+	if (k >= 0 && ((k - blockfirst) & (outgoing - 1)) < blocknum) {
+	  if (blockid[k] == id && blocktime[k]) {
 	    rtt = recent - blocktime[k];
 	    if (!rtt_average) {
 	      nsecperblock = rtt;
@@ -568,7 +775,7 @@ int main(int argc,char **argv)
 	startbyte = uint64_unpack(message[pos] + 40);
 	stopbyte = startbyte + D;
 
-	if (stopbyte > receivewritten + sizeof receivebuf) {
+	if (stopbyte > receivewritten + receivebufsize) {
 	  break;
 	  /* of course, flow control would avoid this case */
 	}
@@ -577,20 +784,21 @@ int main(int argc,char **argv)
 	  receiveeof = SF;
 	  receivetotalbytes = stopbyte;
 	}
+	if (stopbyte > receivehighest) receivehighest = stopbyte;
 
-	for (k = 0;k < D;++k) {
-	  unsigned char ch = message[pos][len - D + k];
+	for (k = 0;k < D;k += i) {
 	  unsigned long long where = startbyte + k;
-	  if (where >= receivewritten && where < receivewritten + sizeof receivebuf) {
-	    receivevalid[where & (sizeof receivebuf - 1)] = 1;
-	    receivebuf[where & (sizeof receivebuf - 1)] = ch;
+	  i = D - k;
+	  if (where < receivewritten) {
+	    if (receivewritten - where < i) i = receivewritten - where;
+	    continue;
 	  }
+	  where &= receivebufsize - 1;
+	  if (i > receivebufsize - where) i = receivebufsize - where;
+	  byte_copy(receivebuf + where,i,message[pos] + len - D + k);
+	  receivevalid_mark(where,i,1);
 	}
-	for (;;) {
-	  if (receivebytes >= receivewritten + sizeof receivebuf) break;
-	  if (!receivevalid[receivebytes & (sizeof receivebuf - 1)]) break;
-	  ++receivebytes;
-	}
+	receivebytes = receivevalid_scan(receivebytes,receivewritten + receivebufsize,1);
 
 	if (!uint32_unpack(message[pos])) break; /* never acknowledge a pure acknowledgment */
 
@@ -601,9 +809,22 @@ int main(int argc,char **argv)
 	byte_copy(buf + 12,4,message[pos]);
 	if (receiveeof && receivebytes == receivetotalbytes) {
 	  uint64_pack(buf + 16,receivebytes + 1);
-	} else
+	} else {
 	  uint64_pack(buf + 16,receivebytes);
-	/* XXX: incorporate selective acknowledgments */
+	  /* selective acknowledgments: next five ranges received beyond receivebytes */
+	  startbyte = receivebytes;
+	  for (i = 0;i < 5;++i) {
+	    stopbyte = receivevalid_scan(startbyte,receivehighest,0);
+	    if (stopbyte >= receivehighest) break;
+	    if (stopbyte - startbyte > (i ? 65535 : 4294967295ULL)) break;
+	    if (i) uint16_pack(buf + 26 + 4 * i,stopbyte - startbyte);
+	    else uint32_pack(buf + 24,stopbyte - startbyte);
+	    startbyte = receivehighest;
+	    if (startbyte > stopbyte + 65535) startbyte = stopbyte + 65535;
+	    startbyte = receivevalid_scan(stopbyte,startbyte,1);
+	    uint16_pack(buf + 28 + 4 * i,startbyte - stopbyte);
+	  }
+	}
   
         if (writeall(9,buf + 7,u + 1) == -1) die_fatal("unable to write descriptor 9",0,0);
       } while(0);
@@ -617,9 +838,9 @@ int main(int argc,char **argv)
       if (tochild[1] < 0) { receivewritten = receivebytes; break; }
       if (receivewritten >= receivebytes) break;
 
-      pos = receivewritten & (sizeof receivebuf - 1);
+      pos = receivewritten & (receivebufsize - 1);
       len = receivebytes - receivewritten;
-      if (pos + len > sizeof receivebuf) len = sizeof receivebuf - pos;
+      if (pos + len > receivebufsize) len = receivebufsize - pos;
       r = write(tochild[1],receivebuf + pos,len);
       if (r == -1) if (errno == EINTR || errno == EWOULDBLOCK || errno == EAGAIN) break;
       if (r <= 0) {
@@ -627,7 +848,7 @@ int main(int argc,char **argv)
         tochild[1] = -1;
 	break;
       }
-      byte_zero(receivevalid + pos,r);
+      receivevalid_mark(pos,r,0);
       receivewritten += r;
     } while(0);
 
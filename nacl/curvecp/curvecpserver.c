@@ -5,6 +5,11 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <poll.h>
+#include <sys/mman.h>
+#include <dlfcn.h>
+#ifdef __linux__
+#include <sys/epoll.h>
+#endif
 #include "e.h"
 #include "die.h"
 #include "byte.h"
@@ -16,6 +21,8 @@
 #include "writeall.h"
 #include "nanoseconds.h"
 #include "safenonce.h"
+#include "secretcache.h"
+#include "curvecphandler.h"
 #include "nameparse.h"
 #include "hexparse.h"
 #include "portparse.h"
@@ -23,6 +30,8 @@
 
 #include "randombytes.h"
 #include "crypto_box.h"
+#include "crypto_onetimeauth.h"
+#include "crypto_scalarmult.h"
 #include "crypto_secretbox.h"
 #if crypto_box_PUBLICKEYBYTES != 32
 error!
@@ -60,12 +69,18 @@ curvecpserver:   -q (optional): no error messages\n\
 curvecpserver:   -Q (optional): print error messages (default)\n\
 curvecpserver:   -v (optional): print extra information\n\
 curvecpserver:   -c n (optional): allow at most n clients at once (default 100)\n\
+curvecpserver:   -t n (optional): run n worker processes on the same port (default 1)\n\
+curvecpserver:   -k n (optional): cache shared secrets for n client keys (default 1024)\n\
+curvecpserver:   -K (optional): keep that cache in keydir/.expertsonly/sharedcache\n\
+curvecpserver:   -e (optional): prog is a shared object with an embedded handler\n\
+curvecpserver:   -i n (optional): with -e, end clients silent for n seconds (default 60)\n\
+curvecpserver:   -p n (optional): keep n copies of prog started in advance (default 0)\n\
 curvecpserver:   sname: server's name\n\
 curvecpserver:   keydir: use this public-key directory\n\
 curvecpserver:   ip: server's IP address\n\
 curvecpserver:   port: server's UDP port\n\
 curvecpserver:   ext: server's extension\n\
-curvecpserver:   prog: run this server\n\
+curvecpserver:   prog: run this server (with -e: load this handler; see curvecphandler.h)\n\
 "
 
 void die_usage(const char *s)
@@ -125,6 +140,81 @@ long long nextminute;
 unsigned char minutekey[32];
 unsigned char lastminutekey[32];
 
+/* minute keys shared by all workers, rotated by one process: */
+/* seqlock: seq is odd while the keys are being replaced */
+struct sharedminutekeys {
+  volatile crypto_uint64 seq;
+  unsigned char minutekey[32];
+  unsigned char lastminutekey[32];
+} ;
+struct sharedminutekeys *sharedminutekeys = 0;
+crypto_uint64 minutekeyseq = 1; /* seq of local copy; odd forces first load */
+
+void minutekeys_rotate(void)
+{
+  unsigned char newkey[32];
+  randombytes(newkey,sizeof newkey);
+  ++sharedminutekeys->seq;
+  __sync_synchronize();
+  byte_copy(sharedminutekeys->lastminutekey,32,sharedminutekeys->minutekey);
+  byte_copy(sharedminutekeys->minutekey,32,newkey);
+  __sync_synchronize();
+  ++sharedminutekeys->seq;
+  randombytes(newkey,sizeof newkey);
+}
+
+void minutekeys_load(void)
+{
+  crypto_uint64 seq;
+  for (;;) {
+    seq = sharedminutekeys->seq;
+    if (seq == minutekeyseq) return;
+    if (seq & 1) continue;
+    __sync_synchronize();
+    byte_copy(minutekey,32,sharedminutekeys->minutekey);
+    byte_copy(lastminutekey,32,sharedminutekeys->lastminutekey);
+    __sync_synchronize();
+    if (sharedminutekeys->seq == seq) { minutekeyseq = seq; return; }
+  }
+}
+
+/* workers: */
+const char *strnumworkers = "1";
+long long numworkers = 0;
+pid_t supervisor = -1;
+int lifeline[2] = {-1,-1}; /* supervisor sees eof when every worker is gone */
+
+/* cache of clientlongserverlong: */
+const char *strcachesize = "1024";
+long long cachesize = 0;
+int flagcachefile = 0;
+
+/* copies of prog started in advance: */
+struct idlechild {
+  pid_t child;
+  int tochild;
+  int fromchild;
+} ;
+const char *strpoolsize = 0;
+long long poolsize = 0;
+long long poolnum = 0;
+struct idlechild *pool = 0;
+int poolstalled = 0; /* last refill failed; retry next minute */
+
+/* embedded handler: */
+/* the handler names clients by number, which stays put while activeclients moves */
+int flagembedded = 0;
+struct curvecphandler *handler = 0;
+const char *stridle = "60";
+long long idle = 0; /* nanoseconds */
+long long *handlerslot = 0; /* client number -> position in activeclients, or -1 */
+long long *handlerfree = 0; /* stack of unused client numbers */
+long long numhandlerfree = 0;
+long long numending = 0; /* clients the handler asked to end */
+long long handlernow = 0; /* nanoseconds(), once per pass through the event loop */
+long long nextidlecheck = 0;
+unsigned char handlermessage[1088];
+
 /* routing to the server: */
 unsigned char serverip[4];
 unsigned char serverport[2];
@@ -135,6 +225,7 @@ int udpfd = -1;
 char *keydir = 0;
 unsigned char servername[256];
 unsigned char serverlongtermsk[32];
+unsigned char serverlongtermpk[32];
 unsigned char servershorttermpk[32];
 unsigned char servershorttermsk[32];
 
@@ -160,6 +251,26 @@ unsigned char packetport[2];
 unsigned char packet[4096];
 crypto_uint64 packetnonce;
 
+/* batched UDP I/O: */
+#define BATCH 32
+struct socket_packet inbatch[BATCH];
+unsigned char inbuf[BATCH][4096];
+long long innum = 0;
+long long inpos = 0;
+struct socket_packet outbatch[BATCH];
+unsigned char outbuf[BATCH][1184];
+long long outnum = 0;
+
+/* crypto_box_afternm is crypto_secretbox under the precomputed key, */
+/* so a batch of Message packets is opened or sealed in one multi call: */
+unsigned char intext[BATCH][1184]; /* opened Message packets */
+unsigned char inkey[BATCH][32];
+int inresult[BATCH]; /* under inkey, 0: opened into intext; -1: forged; 1: not tried */
+long long sealnum = 0; /* Message packets in outbatch still to be sealed */
+long long sealpos[BATCH];
+unsigned char sealnonce[BATCH][24];
+unsigned char sealkey[BATCH][32];
+
 #define MESSAGELEN 1104
 
 struct activeclient {
@@ -171,6 +282,10 @@ struct activeclient {
   pid_t child;
   int tochild;
   int fromchild;
+  void *conn; /* embedded handler's connection */
+  long long client; /* embedded handler's number for it */
+  long long lastheard; /* embedded: handlernow at the last message */
+  int ending; /* embedded: handler asked to end it */
   unsigned char clientextension[16];
   unsigned char clientip[4];
   unsigned char clientport[2];
@@ -181,13 +296,396 @@ const char *strmaxactiveclients = "100";
 long long maxactiveclients = 0;
 long long numactiveclients = 0;
 struct activeclient *activeclients = 0;
+
+/* index of activeclients by clientshorttermpk: */
+/* open addressing, linear probing, at most half full */
+/* home slot is a secret-keyed poly1305 of the whole key, */
+/* so clients cannot choose keys that pile onto one probe sequence */
+long long *clienthash = 0; /* -1 for empty slot, otherwise position in activeclients */
+long long clienthashbits = 0;
+unsigned char clienthashkey[32];
+
+long long clienthash_home(const unsigned char *pk)
+{
+  unsigned char h[16];
+  crypto_onetimeauth(h,pk,32,clienthashkey);
+  return uint64_unpack(h) >> (64 - clienthashbits);
+}
+
+/* position holding pk, or empty position where pk belongs */
+long long clienthash_find(const unsigned char *pk)
+{
+  long long mask = (1LL << clienthashbits) - 1;
+  long long pos = clienthash_home(pk);
+  while (clienthash[pos] != -1) {
+    if (byte_isequal(activeclients[clienthash[pos]].clientshorttermpk,32,pk)) break;
+    pos = (pos + 1) & mask;
+  }
+  return pos;
+}
+
+void clienthash_remove(long long pos)
+{
+  long long mask = (1LL << clienthashbits) - 1;
+  long long j = pos;
+  long long home;
+
+  /* backward-shift deletion: no tombstones, so probes stay short */
+  for (;;) {
+    j = (j + 1) & mask;
+    if (clienthash[j] == -1) break;
+    home = clienthash_home(activeclients[clienthash[j]].clientshorttermpk);
+    if (((j - home) & mask) >= ((j - pos) & mask)) {
+      clienthash[pos] = clienthash[j];
+      pos = j;
+    }
+  }
+  clienthash[pos] = -1;
+}
+
+void packet_flush(void)
+{
+  unsigned char *c[BATCH];
+  const unsigned char *m[BATCH];
+  unsigned long long mlen[BATCH];
+  const unsigned char *n[BATCH];
+  const unsigned char *k[BATCH];
+  unsigned char *x;
+  long long j;
+
+  /* each box is at x + 32; its 16 leading zeros land under the header */
+  for (j = 0;j < sealnum;++j) {
+    x = outbuf[sealpos[j]];
+    c[j] = x + 32;
+    m[j] = x + 32;
+    mlen[j] = outbatch[sealpos[j]].xlen - 32;
+    n[j] = sealnonce[j];
+    k[j] = sealkey[j];
+  }
+  if (sealnum) crypto_secretbox_multi(c,m,mlen,n,k,sealnum);
+  for (j = 0;j < sealnum;++j) {
+    x = outbuf[sealpos[j]];
+    byte_copy(x + 24,16,serverextension);
+    byte_copy(x + 40,8,sealnonce[j] + 16);
+  }
+  sealnum = 0;
+
+  if (outnum) socket_sendbatch(udpfd,outbatch,outnum);
+  outnum = 0;
+}
+
+void packet_queue(const unsigned char *x,long long xlen,const unsigned char *ip,const unsigned char *port)
+{
+  if (xlen > sizeof outbuf[0]) return;
+  if (outnum == BATCH) packet_flush();
+  outbatch[outnum].x = outbuf[outnum];
+  outbatch[outnum].xlen = xlen;
+  byte_copy(outbuf[outnum],xlen,x);
+  byte_copy(outbatch[outnum].ip,4,ip);
+  byte_copy(outbatch[outnum].port,2,port);
+  ++outnum;
+}
+
+/* event loop: */
+/* epoll where available, registering each descriptor once; otherwise poll */
+/* after events_wait: udpready, and readylist holding clients in decreasing order */
+int udpready = 0;
+long long *readylist = 0;
+long long numready = 0;
+
+#ifdef EPOLLET
+
+int epfd = -1;
+struct epoll_event *events = 0;
+
+void events_init(void)
+{
+  struct epoll_event ev;
+  epfd = epoll_create(1 + maxactiveclients);
+  if (epfd == -1) die_fatal("unable to create epoll descriptor",0,0);
+  fcntl(epfd,F_SETFD,1);
+  events = malloc((1 + maxactiveclients) * sizeof(struct epoll_event));
+  if (!events) die_fatal("unable to create event array",0,0);
+  byte_zero(&ev,sizeof ev);
+  ev.events = EPOLLIN | EPOLLET;
+  ev.data.u64 = 0;
+  if (epoll_ctl(epfd,EPOLL_CTL_ADD,udpfd,&ev) == -1) die_fatal("unable to watch socket",0,0);
+}
+
+/* edge-triggered, so the child descriptor must be drained on every event */
+int events_addclient(long long i)
+{
+  struct epoll_event ev;
+  byte_zero(&ev,sizeof ev);
+  ev.events = EPOLLIN | EPOLLET;
+  ev.data.u64 = i + 1;
+  return epoll_ctl(epfd,EPOLL_CTL_ADD,activeclients[i].fromchild,&ev);
+}
+
+void events_delclient(long long i)
+{
+  struct epoll_event ev;
+  epoll_ctl(epfd,EPOLL_CTL_DEL,activeclients[i].fromchild,&ev);
+}
+
+/* client moved to position i */
+void events_moveclient(long long i)
+{
+  struct epoll_event ev;
+  byte_zero(&ev,sizeof ev);
+  ev.events = EPOLLIN | EPOLLET;
+  ev.data.u64 = i + 1;
+  epoll_ctl(epfd,EPOLL_CTL_MOD,activeclients[i].fromchild,&ev);
+}
+
+int events_wait(long long timeout)
+{
+  long long r;
+  long long j;
+  long long k;
+  long long t;
+
+  r = epoll_wait(epfd,events,1 + maxactiveclients,timeout);
+  if (r < 0) return -1;
+  numready = 0;
+  for (j = 0;j < r;++j) {
+    if (events[j].data.u64 == 0) { udpready = 1; continue; }
+    readylist[numready++] = events[j].data.u64 - 1;
+  }
+  /* usually one or two entries: insertion sort */
+  for (j = 1;j < numready;++j) {
+    t = readylist[j];
+    for (k = j;k > 0 && readylist[k - 1] < t;--k) readylist[k] = readylist[k - 1];
+    readylist[k] = t;
+  }
+  return 0;
+}
+
+#else
+
 struct pollfd *p;
 
+void events_init(void)
+{
+  p = malloc((1 + maxactiveclients) * sizeof(struct pollfd));
+  if (!p) die_fatal("unable to create poll array",0,0);
+}
+
+int events_addclient(long long i) { return 0; }
+void events_delclient(long long i) { }
+void events_moveclient(long long i) { }
+
+int events_wait(long long timeout)
+{
+  long long i;
+
+  for (i = 0;i < numactiveclients;++i) {
+    p[i].fd = activeclients[i].fromchild;
+    p[i].events = POLLIN;
+  }
+  p[numactiveclients].fd = udpfd;
+  p[numactiveclients].events = POLLIN;
+  if (poll(p,1 + numactiveclients,timeout) < 0) return -1;
+  if (p[numactiveclients].revents) udpready = 1;
+  numready = 0;
+  for (i = numactiveclients - 1;i >= 0;--i)
+    if (p[i].revents) readylist[numready++] = i;
+  return 0;
+}
+
+#endif
+
+/* sealed later by packet_flush, together with the rest of the batch */
+void message_send(long long i,const unsigned char *m,long long mlen)
+{
+  unsigned char *x;
+
+  if (outnum == BATCH) packet_flush();
+  x = outbuf[outnum];
+  byte_copy(x,8,"RL3aNMXM");
+  byte_copy(x + 8,16,activeclients[i].clientextension);
+  byte_zero(x + 32,32);
+  byte_copy(x + 64,mlen,m);
+  byte_copy(sealnonce[sealnum],16,"CurveCP-server-M");
+  uint64_pack(sealnonce[sealnum] + 16,++activeclients[i].sentnonce);
+  byte_copy(sealkey[sealnum],32,activeclients[i].clientshortservershort);
+  sealpos[sealnum++] = outnum;
+  outbatch[outnum].x = x;
+  outbatch[outnum].xlen = mlen + 64;
+  byte_copy(outbatch[outnum].ip,4,activeclients[i].clientip);
+  byte_copy(outbatch[outnum].port,2,activeclients[i].clientport);
+  ++outnum;
+}
+
+/* position of the handler's client c in activeclients, or -1 */
+long long handler_find(long long c)
+{
+  long long i;
+  if (c < 0 || c >= maxactiveclients) return -1;
+  i = handlerslot[c];
+  if (i < 0 || activeclients[i].ending) return -1;
+  return i;
+}
+
+int handler_reply(long long c,const unsigned char *m,long long mlen)
+{
+  long long i = handler_find(c);
+  if (i < 0) return -1;
+  if (mlen < 16 || mlen > 1088 || (mlen & 15)) return -1;
+  message_send(i,m,mlen);
+  return 0;
+}
+
+/* the handler may be in the middle of a call about this client: */
+/* ending waits for handler_sweep or the end of client_deliver */
+void handler_end(long long c)
+{
+  long long i = handler_find(c);
+  if (i < 0) return;
+  activeclients[i].ending = 1;
+  ++numending;
+}
+
+const struct curvecpserverops handlerops = { handler_reply, handler_end };
+
+void client_end(long long i)
+{
+  void *conn = activeclients[i].conn;
+
+  /* XXX: cache cookie if it's recent */
+  if (activeclients[i].fromchild >= 0) {
+    events_delclient(i);
+    close(activeclients[i].fromchild); activeclients[i].fromchild = -1;
+    close(activeclients[i].tochild); activeclients[i].tochild = -1;
+  }
+  if (handler) {
+    if (activeclients[i].ending) --numending;
+    handlerslot[activeclients[i].client] = -1;
+    handlerfree[numhandlerfree++] = activeclients[i].client;
+  }
+  clienthash_remove(clienthash_find(activeclients[i].clientshorttermpk));
+  --numactiveclients;
+  activeclients[i] = activeclients[numactiveclients];
+  if (i < numactiveclients) {
+    clienthash[clienthash_find(activeclients[i].clientshorttermpk)] = i;
+    if (activeclients[i].fromchild >= 0) events_moveclient(i);
+    if (handler) handlerslot[activeclients[i].client] = i;
+  }
+  randombytes((void *) &activeclients[numactiveclients],sizeof(struct activeclient));
+  /* after the client is gone, so close cannot reply to it */
+  if (handler) handler->close(conn);
+}
+
+void client_deliver(long long i,unsigned char *m,long long mlen)
+{
+  /* m is in text, with room for the length byte before it */
+  if (!handler) {
+    m[-1] = mlen >> 4;
+    if (writeall(activeclients[i].tochild,m - 1,mlen + 1) == -1)
+      ; /* child is gone; will see eof later */
+    return;
+  }
+  if (activeclients[i].ending) return;
+  activeclients[i].lastheard = handlernow;
+  byte_copy(handlermessage,mlen,m);
+  if (handler->message(activeclients[i].conn,handlermessage,mlen) == -1 || activeclients[i].ending)
+    client_end(i);
+}
+
+/* ends clients the handler asked to end, and once a second those silent for idle */
+void handler_sweep(void)
+{
+  long long i;
+
+  if (!numending && handlernow < nextidlecheck) return;
+  /* decreasing order: client_end only moves clients that were already checked */
+  for (i = numactiveclients - 1;i >= 0;--i)
+    if (activeclients[i].ending || handlernow - activeclients[i].lastheard > idle)
+      client_end(i);
+  if (handlernow >= nextidlecheck) nextidlecheck = handlernow + 1000000000;
+}
+
+/* open every Message packet from a known client in the batch at once */
+void messages_open(void)
+{
+  unsigned char *m[BATCH];
+  const unsigned char *c[BATCH];
+  unsigned long long clen[BATCH];
+  const unsigned char *n[BATCH];
+  const unsigned char *k[BATCH];
+  unsigned char nonces[BATCH][24];
+  long long pos[BATCH];
+  int result[BATCH];
+  long long num = 0;
+  unsigned char *x;
+  long long r;
+  long long i;
+  long long j;
+
+  for (j = 0;j < innum;++j) {
+    inresult[j] = 1;
+    x = inbatch[j].x;
+    r = inbatch[j].xlen;
+    if (r < 112) continue;
+    if (r > 1184) continue;
+    if (r & 15) continue;
+    if (!(byte_isequal(x,8,"QvnQ5XlM") & byte_isequal(x + 8,16,serverextension))) continue;
+    i = clienthash[clienthash_find(x + 40)];
+    if (i < 0) continue;
+    if (uint64_unpack(x + 72) <= activeclients[i].receivednonce) continue;
+    byte_copy(inkey[j],32,activeclients[i].clientshortservershort);
+    byte_copy(nonces[num],16,"CurveCP-client-M");
+    byte_copy(nonces[num] + 16,8,x + 72);
+    byte_zero(intext[j],16);
+    byte_copy(intext[j] + 16,r - 80,x + 80);
+    m[num] = intext[j];
+    c[num] = intext[j];
+    clen[num] = r - 64;
+    n[num] = nonces[num];
+    k[num] = inkey[j];
+    pos[num++] = j;
+  }
+  if (!num) return;
+  crypto_secretbox_open_multi(m,c,clen,n,k,result,num);
+  for (j = 0;j < num;++j) inresult[pos[j]] = result[j];
+}
+
 int fdwd = -1;
+char **prog;
 
 int pi0[2];
 int pi1[2];
 
+int child_spawn(pid_t *child,int *tochild,int *fromchild,int pooled)
+{
+  if (open_pipe(pi0) == -1) return -1;
+  if (open_pipe(pi1) == -1) { close(pi0[0]); close(pi0[1]); return -1; }
+
+  *child = fork();
+  if (*child == -1) {
+    close(pi0[0]); close(pi0[1]);
+    close(pi1[0]); close(pi1[1]);
+    return -1;
+  }
+  if (*child == 0) {
+    if (fchdir(fdwd) == -1) die_fatal("unable to chdir to original directory",0,0);
+    close(8);
+    if (dup(pi0[0]) != 8) die_fatal("unable to dup",0,0);
+    close(9);
+    if (dup(pi1[1]) != 9) die_fatal("unable to dup",0,0);
+    /* XXX: set up environment variables */
+    if (pooled) if (setenv("CURVECPPOOLED","1",1) == -1) die_fatal("unable to set environment",0,0);
+    signal(SIGPIPE,SIG_DFL);
+    signal(SIGCHLD,SIG_DFL);
+    execvp(*prog,prog);
+    die_fatal("unable to run",*prog,0);
+  }
+
+  *tochild = pi0[1]; close(pi0[0]);
+  *fromchild = pi1[0]; close(pi1[1]);
+  return 0;
+}
+
 unsigned char childbuf[4096];
 long long childbuflen = 0;
 unsigned char childmessage[2048];
@@ -197,6 +695,7 @@ int main(int argc,char **argv)
 {
   long long r;
   long long i;
+  long long j;
   long long k;
 
   signal(SIGPIPE,SIG_IGN);
@@ -218,16 +717,41 @@ int main(int argc,char **argv)
         if (x[1]) { strmaxactiveclients = x + 1; break; }
 	if (argv[1]) { strmaxactiveclients = *++argv; break; }
       }
+      if (*x == 't') {
+        if (x[1]) { strnumworkers = x + 1; break; }
+	if (argv[1]) { strnumworkers = *++argv; break; }
+      }
+      if (*x == 'k') {
+        if (x[1]) { strcachesize = x + 1; break; }
+	if (argv[1]) { strcachesize = *++argv; break; }
+      }
+      if (*x == 'K') { flagcachefile = 1; continue; }
+      if (*x == 'e') { flagembedded = 1; continue; }
+      if (*x == 'i') {
+        if (x[1]) { stridle = x + 1; break; }
+	if (argv[1]) { stridle = *++argv; break; }
+      }
+      if (*x == 'p') {
+        if (x[1]) { strpoolsize = x + 1; break; }
+	if (argv[1]) { strpoolsize = *++argv; break; }
+      }
       die_usage(0);
     }
   }
   if (!maxparse(&maxactiveclients,strmaxactiveclients)) die_usage("concurrency must be between 1 and 65535");
+  if (!maxparse(&numworkers,strnumworkers)) die_usage("workers must be between 1 and 65535");
+  if (!maxparse(&cachesize,strcachesize)) die_usage("cache size must be between 1 and 65535");
+  if (!maxparse(&idle,stridle)) die_usage("idle timeout must be between 1 and 65535");
+  idle *= 1000000000LL;
+  if (strpoolsize)
+    if (!maxparse(&poolsize,strpoolsize)) die_usage("pool size must be between 1 and 65535");
   if (!nameparse(servername,*++argv)) die_usage("sname must be at most 255 bytes, at most 63 bytes between dots");
   keydir = *++argv; if (!keydir) die_usage("missing keydir");
   if (!ipparse(serverip,*++argv)) die_usage("ip must be an IPv4 address");
   if (!portparse(serverport,*++argv)) die_usage("port must be an integer between 0 and 65535");
   if (!hexparse(serverextension,16,*++argv)) die_usage("ext must be exactly 32 hex characters");
   if (!*++argv) die_usage("missing prog");
+  prog = argv;
 
   for (;;) {
     r = open_read("/dev/null");
@@ -246,35 +770,110 @@ int main(int argc,char **argv)
     activeclients[i].sentnonce = randommod(281474976710656LL);
   }
   
-  p = malloc((1 + maxactiveclients) * sizeof(struct pollfd));
-  if (!p) die_fatal("unable to create poll array",0,0);
+  if (poolsize && !flagembedded) {
+    pool = malloc(poolsize * sizeof(struct idlechild));
+    if (!pool) die_fatal("unable to create child pool",0,0);
+  } else
+    poolsize = 0;
+
+  readylist = malloc(maxactiveclients * sizeof(long long));
+  if (!readylist) die_fatal("unable to create ready list",0,0);
+
+  clienthashbits = 1;
+  while ((1LL << clienthashbits) < 2 * maxactiveclients) ++clienthashbits;
+  clienthash = malloc((1LL << clienthashbits) * sizeof(long long));
+  if (!clienthash) die_fatal("unable to create client hash table",0,0);
+  for (i = 0;i < (1LL << clienthashbits);++i) clienthash[i] = -1;
+  randombytes(clienthashkey,sizeof clienthashkey);
+
+  if (flagembedded) {
+    void *h = dlopen(*argv,RTLD_NOW);
+    if (h) handler = dlsym(h,"curvecphandler");
+    if (!handler) {
+      if (!flagverbose) die_0(111);
+      die_5(111,"curvecpserver: fatal: ","unable to load handler: ",dlerror(),"\n",0);
+    }
+    handlerslot = malloc(maxactiveclients * sizeof(long long));
+    handlerfree = malloc(maxactiveclients * sizeof(long long));
+    if (!handlerslot || !handlerfree) die_fatal("unable to create handler client table",0,0);
+    for (i = 0;i < maxactiveclients;++i) {
+      handlerslot[i] = -1;
+      handlerfree[i] = maxactiveclients - 1 - i;
+    }
+    numhandlerfree = maxactiveclients;
+    if (handler->init)
+      if (handler->init(argv + 1,&handlerops) == -1) die_fatal("unable to initialize handler",*argv,0);
+  }
 
   fdwd = open_cwd();
   if (fdwd == -1) die_fatal("unable to open current directory",0,0);
 
   if (chdir(keydir) == -1) die_fatal("unable to chdir to",keydir,0);
   if (load(".expertsonly/secretkey",serverlongtermsk,sizeof serverlongtermsk) == -1) die_fatal("unable to read secret key from",keydir,0);
+  crypto_scalarmult_base(serverlongtermpk,serverlongtermsk);
+  if (secretcache_init(cachesize,flagcachefile ? ".expertsonly/sharedcache" : 0,serverlongtermpk) == -1)
+    die_fatal("unable to create shared-secret cache in",keydir,0);
+
+  sharedminutekeys = mmap(0,sizeof(struct sharedminutekeys),PROT_READ | PROT_WRITE,MAP_SHARED | MAP_ANONYMOUS,-1,0);
+  if (sharedminutekeys == MAP_FAILED) die_fatal("unable to create shared minute keys",0,0);
+  sharedminutekeys->seq = 0;
+  randombytes(sharedminutekeys->minutekey,32);
+  randombytes(sharedminutekeys->lastminutekey,32);
+  nextminute = nanoseconds() + 60000000000ULL;
+
+  if (numworkers > 1) {
+    supervisor = getpid();
+    if (open_pipe(lifeline) == -1) die_fatal("unable to create pipe",0,0);
+    for (i = 0;i < numworkers;++i) {
+      r = fork();
+      if (r == -1) die_fatal("unable to fork",0,0);
+      if (r == 0) break;
+    }
+    if (i == numworkers) { /* supervisor: rotate minute keys until the workers are gone */
+      struct pollfd pl;
+      close(lifeline[1]);
+      for (;;) {
+        long long timeout = nextminute - nanoseconds();
+        if (timeout <= 0) {
+          minutekeys_rotate();
+          nextminute = nanoseconds() + 60000000000ULL;
+          continue;
+        }
+        pl.fd = lifeline[0];
+        pl.events = POLLIN;
+        if (poll(&pl,1,timeout / 1000000 + 1) <= 0) continue;
+        if (read(lifeline[0],childbuf,1) == 0) {
+          if (!flagverbose) die_0(111);
+          die_3(111,"curvecpserver: fatal: ","all workers exited","\n");
+        }
+      }
+    }
+    close(lifeline[0]);
+  }
 
   udpfd = socket_udp();
   if (udpfd == -1) die_fatal("unable to create socket",0,0);
-  if (socket_bind(udpfd,serverip,serverport) == -1) die_fatal("unable to bind socket",0,0);
+  if (numworkers > 1) {
+    if (socket_bind_reuse(udpfd,serverip,serverport) == -1) die_fatal("unable to bind socket",0,0);
+  } else {
+    if (socket_bind(udpfd,serverip,serverport) == -1) die_fatal("unable to bind socket",0,0);
+  }
 
-  randombytes(minutekey,sizeof minutekey);
-  randombytes(lastminutekey,sizeof lastminutekey);
-  nextminute = nanoseconds() + 60000000000ULL;
+  events_init();
 
   for (;;) {
     long long timeout = nextminute - nanoseconds();
     if (timeout <= 0) {
       timeout = 60000000000ULL;
-      byte_copy(lastminutekey,sizeof lastminutekey,minutekey);
-      randombytes(minutekey,sizeof minutekey);
+      if (numworkers == 1) minutekeys_rotate();
+      poolstalled = 0;
       nextminute = nanoseconds() + timeout;
       randombytes(packet,sizeof packet);
       randombytes(packetip,sizeof packetip);
       randombytes(packetport,sizeof packetport);
       randombytes(clientshorttermpk,sizeof clientshorttermpk);
       randombytes(clientshortserverlong,sizeof clientshortserverlong);
+      randombytes(clientlongserverlong,sizeof clientlongserverlong);
       randombytes(nonce,sizeof nonce);
       randombytes(text,sizeof text);
       randombytes(childbuf,sizeof childbuf);
@@ -282,21 +881,49 @@ int main(int argc,char **argv)
       randombytes(servershorttermpk,sizeof servershorttermpk);
       randombytes(servershorttermsk,sizeof servershorttermsk);
     }
+    minutekeys_load();
+
+    if (numworkers > 1) {
+      /* stale keys must not outlive the supervisor for long */
+      if (getppid() != supervisor) { errno = ESRCH; die_fatal("supervisor is gone",0,0); }
+      if (timeout > 1000000000) timeout = 1000000000;
+    }
+
+    if (udpready) timeout = 0; /* socket not yet drained */
+    else timeout = timeout / 1000000 + 1;
+    if (poolnum < poolsize && !poolstalled) if (timeout > 1) timeout = 1;
+    if (handler) if (timeout > 100) timeout = 100; /* tick and idle checks */
+    if (events_wait(timeout) < 0) continue;
+    if (handler) handlernow = nanoseconds();
 
-    for (i = 0;i < numactiveclients;++i) {
-      p[i].fd = activeclients[i].fromchild;
-      p[i].events = POLLIN;
+    if (!udpready && !numready && poolnum < poolsize && !poolstalled) {
+      /* refill pool only after a quiet millisecond; */
+      /* a new child starting up would compete with the one just handed out */
+      if (child_spawn(&pool[poolnum].child,&pool[poolnum].tochild,&pool[poolnum].fromchild,1) == -1)
+        poolstalled = 1;
+      else
+        ++poolnum;
     }
-    p[numactiveclients].fd = udpfd;
-    p[numactiveclients].events = POLLIN;
-    if (poll(p,1 + numactiveclients,timeout / 1000000 + 1) < 0) continue;
 
-    do { /* try receiving a packet: */
-      if (!p[numactiveclients].revents) break;
-      r = socket_recv(udpfd,packet,sizeof packet,packetip,packetport);
+    innum = 0;
+    if (udpready) { /* try receiving a batch of packets: */
+      for (inpos = 0;inpos < BATCH;++inpos) {
+        inbatch[inpos].x = inbuf[inpos];
+        inbatch[inpos].xlen = sizeof inbuf[inpos];
+      }
+      innum = socket_recvbatch(udpfd,inbatch,BATCH);
+      if (innum < BATCH) udpready = 0;
+      messages_open();
+    }
+
+    for (inpos = 0;inpos < innum;++inpos) do { /* handle a packet: */
+      r = inbatch[inpos].xlen;
       if (r < 80) break;
       if (r > 1184) break;
       if (r & 15) break;
+      byte_copy(packet,r,inbatch[inpos].x);
+      byte_copy(packetip,4,inbatch[inpos].ip);
+      byte_copy(packetport,2,inbatch[inpos].port);
       if (!(byte_isequal(packet,7,"QvnQ5Xl") & byte_isequal(packet + 8,16,serverextension))) break;
       byte_copy(clientextension,16,packet + 24);
       if (packet[7] == 'H') { /* Hello packet: */
@@ -331,14 +958,12 @@ int main(int argc,char **argv)
 	byte_copy(packet + 40,16,nonce + 8);
 	byte_copy(packet + 56,144,text + 16);
 
-	socket_send(udpfd,packet,200,packetip,packetport);
+	packet_queue(packet,200,packetip,packetport);
       }
       if (packet[7] == 'I') { /* Initiate packet: */
         if (r < 560) break;
-	for (i = 0;i < numactiveclients;++i) /* XXX use better data structure */
-	  if (byte_isequal(activeclients[i].clientshorttermpk,32,packet + 40))
-	    break;
-	if (i < numactiveclients) {
+	i = clienthash[clienthash_find(packet + 40)];
+	if (i >= 0) {
 	  packetnonce = uint64_unpack(packet + 168);
 	  if (packetnonce <= activeclients[i].receivednonce) break;
 	  byte_copy(nonce,16,"CurveCP-client-I");
@@ -349,12 +974,11 @@ int main(int argc,char **argv)
 
 	  /* XXX: update clientip, clientextension; but not if client has spoken recently */
 	  activeclients[i].receivednonce = packetnonce;
-	  text[383] = (r - 544) >> 4;
-	  if (writeall(activeclients[i].tochild,text + 383,r - 543) == -1)
-	    ; /* child is gone; will see eof later */
+	  client_deliver(i,text + 384,r - 544);
 	  break;
 	}
-	if (i == maxactiveclients) break;
+	if (numactiveclients == maxactiveclients) break;
+	i = numactiveclients;
 
 	byte_copy(nonce,8,"minute-k");
 	byte_copy(nonce + 8,16,packet + 72);
@@ -381,38 +1005,36 @@ int main(int argc,char **argv)
 	/* XXX skip if client authentication is not desired: */
 	byte_copy(clientlongtermpk,32,text + 32);
 	/* XXX impose policy limitations on clients: known, maxconn */
-	/* XXX for known clients, retrieve shared secret from cache: */
-	crypto_box_beforenm(clientlongserverlong,clientlongtermpk,serverlongtermsk);
+	if (secretcache_get(clientlongserverlong,clientlongtermpk) == -1)
+	  crypto_box_beforenm(clientlongserverlong,clientlongtermpk,serverlongtermsk);
 	byte_copy(nonce,8,"CurveCPV");
 	byte_copy(nonce + 8,16,text + 64);
 	byte_zero(text + 64,16);
 	if (crypto_box_open_afternm(text + 64,text + 64,64,nonce,clientlongserverlong)) break;
 	if (!byte_isequal(text + 96,32,clientshorttermpk)) break;
+	secretcache_put(clientlongtermpk,clientlongserverlong);
 
-	if (open_pipe(pi0) == -1) break; /* XXX: error message */
-	if (open_pipe(pi1) == -1) { close(pi0[0]); close(pi0[1]); break; } /* XXX: error message */
-
-	activeclients[i].child = fork();
-	if (activeclients[i].child == -1) {
-	  close(pi0[0]); close(pi0[1]);
-	  close(pi1[0]); close(pi1[1]);
-	  break; /* XXX: error message */
+	if (handler) {
+	  activeclients[i].client = handlerfree[numhandlerfree - 1];
+	  activeclients[i].conn = handler->open(activeclients[i].client,clientlongtermpk,clientextension);
+	  if (!activeclients[i].conn) break;
+	  handlerslot[handlerfree[--numhandlerfree]] = i;
+	  activeclients[i].ending = 0;
+	  activeclients[i].lastheard = handlernow;
+	  activeclients[i].child = -1;
+	  activeclients[i].tochild = -1;
+	  activeclients[i].fromchild = -1;
+	} else {
+	  if (poolnum > 0) {
+	    --poolnum;
+	    activeclients[i].child = pool[poolnum].child;
+	    activeclients[i].tochild = pool[poolnum].tochild;
+	    activeclients[i].fromchild = pool[poolnum].fromchild;
+	  } else
+	    if (child_spawn(&activeclients[i].child,&activeclients[i].tochild,&activeclients[i].fromchild,0) == -1)
+	      break; /* XXX: error message */
+	  activeclients[i].conn = 0;
 	}
-	if (activeclients[i].child == 0) {
-	  if (fchdir(fdwd) == -1) die_fatal("unable to chdir to original directory",0,0);
-	  close(8);
-	  if (dup(pi0[0]) != 8) die_fatal("unable to dup",0,0);
-	  close(9);
-	  if (dup(pi1[1]) != 9) die_fatal("unable to dup",0,0);
-	  /* XXX: set up environment variables */
-	  signal(SIGPIPE,SIG_DFL);
-	  signal(SIGCHLD,SIG_DFL);
-	  execvp(*argv,argv);
-	  die_fatal("unable to run",*argv,0);
-	}
-
-	activeclients[i].tochild = pi0[1]; close(pi0[0]);
-	activeclients[i].fromchild = pi1[0]; close(pi1[1]);
 	activeclients[i].messagelen = 0;
 	byte_copy(activeclients[i].clientshorttermpk,32,clientshorttermpk);
 	byte_copy(activeclients[i].clientshortservershort,32,clientshortservershort);
@@ -420,20 +1042,27 @@ int main(int argc,char **argv)
 	byte_copy(activeclients[i].clientextension,16,clientextension);
 	byte_copy(activeclients[i].clientip,4,packetip);
 	byte_copy(activeclients[i].clientport,2,packetport);
+	clienthash[clienthash_find(clientshorttermpk)] = i;
 	++numactiveclients;
+	if (!handler)
+	  if (events_addclient(i) == -1) die_fatal("unable to watch child",0,0);
 
-	text[383] = (r - 544) >> 4;
-	if (writeall(activeclients[i].tochild,text + 383,r - 543) == -1)
-	  ; /* child is gone; will see eof later */
+	client_deliver(i,text + 384,r - 544);
       }
       if (packet[7] == 'M') { /* Message packet: */
         if (r < 112) break;
-        for (i = 0;i < numactiveclients;++i) /* XXX use better data structure */
-	  if (byte_isequal(activeclients[i].clientshorttermpk,32,packet + 40))
-	    break;
-	if (i < numactiveclients) {
+	i = clienthash[clienthash_find(packet + 40)];
+	if (i >= 0) {
 	  packetnonce = uint64_unpack(packet + 72);
 	  if (packetnonce <= activeclients[i].receivednonce) break;
+	  if (inresult[inpos] <= 0 && byte_isequal(inkey[inpos],32,activeclients[i].clientshortservershort)) {
+	    if (inresult[inpos]) break;
+	    /* XXX: update clientip, clientextension */
+	    activeclients[i].receivednonce = packetnonce;
+	    client_deliver(i,intext[inpos] + 32,r - 96);
+	    break;
+	  }
+	  /* not opened yet, or client changed since messages_open: */
           byte_copy(nonce,16,"CurveCP-client-M");
 	  byte_copy(nonce + 16,8,packet + 72);
 	  byte_zero(text,16);
@@ -442,19 +1071,26 @@ int main(int argc,char **argv)
 
 	  /* XXX: update clientip, clientextension */
 	  activeclients[i].receivednonce = packetnonce;
-	  text[31] = (r - 96) >> 4;
-	  if (writeall(activeclients[i].tochild,text + 31,r - 95) == -1)
-	    ; /* child is gone; will see eof later */
+	  client_deliver(i,text + 32,r - 96);
 	  break;
 	}
       }
     } while (0);
 
-    for (i = numactiveclients - 1;i >= 0;--i) {
-      do {
-        if (!p[i].revents) break;
+    if (handler) {
+      if (handler->tick) handler->tick();
+      handler_sweep();
+    }
+
+    packet_flush();
+
+    /* decreasing order: endconnection only moves clients that were already handled */
+    for (j = 0;j < numready;++j) {
+      i = readylist[j];
+      for (;;) { /* drain: epoll is edge-triggered */
 	r = read(activeclients[i].fromchild,childbuf,sizeof childbuf);
-	if (r == -1) if (errno == EINTR || errno == EWOULDBLOCK || errno == EAGAIN) break;
+	if (r == -1) if (errno == EINTR) continue;
+	if (r == -1) if (errno == EWOULDBLOCK || errno == EAGAIN) break;
 	if (r <= 0) goto endconnection;
 	childbuflen = r;
 	for (k = 0;k < childbuflen;++k) {
@@ -467,31 +1103,18 @@ int main(int argc,char **argv)
 	  if (r == 16 * (unsigned long long) activeclients[i].message[0]) {
 	    if (r < 16) goto endconnection;
 	    if (r > 1088) goto endconnection;
-	    byte_copy(nonce,16,"CurveCP-server-M");
-	    uint64_pack(nonce + 16,++activeclients[i].sentnonce);
-	    byte_zero(text,32);
-	    byte_copy(text + 32,r,activeclients[i].message + 1);
-	    crypto_box_afternm(text,text,r + 32,nonce,activeclients[i].clientshortservershort);
-	    byte_copy(packet,8,"RL3aNMXM");
-	    byte_copy(packet + 8,16,clientextension);
-	    byte_copy(packet + 24,16,serverextension);
-	    byte_copy(packet + 40,8,nonce + 16);
-	    byte_copy(packet + 48,r + 16,text + 16);
-	    socket_send(udpfd,packet,r + 64,activeclients[i].clientip,activeclients[i].clientport);
+	    message_send(i,activeclients[i].message + 1,r);
 	    activeclients[i].messagelen = 0;
 	  }
 	}
-	break;
+      }
+      continue;
 
-	endconnection:
+      endconnection:
 
-	/* XXX: cache cookie if it's recent */
-	close(activeclients[i].fromchild); activeclients[i].fromchild = -1;
-	close(activeclients[i].tochild); activeclients[i].tochild = -1;
-	--numactiveclients;
-	activeclients[i] = activeclients[numactiveclients];
-	randombytes((void *) &activeclients[numactiveclients],sizeof(struct activeclient));
-      } while (0);
+      client_end(i);
     }
+
+    packet_flush();
   }
 }
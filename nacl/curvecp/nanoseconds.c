@@ -4,9 +4,15 @@
 /* XXX: Y2036 problems; should upgrade to a 128-bit type for this */
 /* XXX: nanosecond granularity limits users to 1 terabyte per second */
 
+/* callers only measure intervals, so prefer a clock that NTP cannot step */
+
 long long nanoseconds(void)
 {
   struct timespec t;
+#ifdef CLOCK_MONOTONIC
+  if (clock_gettime(CLOCK_MONOTONIC,&t) == 0)
+    return t.tv_sec * 1000000000LL + t.tv_nsec;
+#endif
   if (clock_gettime(CLOCK_REALTIME,&t) != 0) return -1;
   return t.tv_sec * 1000000000LL + t.tv_nsec;
 }
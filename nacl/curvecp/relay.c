@@ -0,0 +1,140 @@
+#include <stdlib.h>
+#include <poll.h>
+#include "byte.h"
+#include "socket.h"
+#include "nanoseconds.h"
+#include "randommod.h"
+#include "relay.h"
+
+/*
+UDP relay between one listening address and one server.
+Each packet is held for a fixed delay in each direction,
+and dropped with probability loss/1000.
+Each client address gets its own socket towards the server,
+so replies find their way back to the right client.
+*/
+
+static unsigned char serverip[4];
+static unsigned char serverport[2];
+static long long delay;
+static long long loss;
+
+static int clientfd = -1; /* bound to relay address; talks to clients */
+
+#define FLOWS 1024
+static struct flow {
+  unsigned char ip[4];
+  unsigned char port[2];
+  int fd; /* talks to server for this client */
+} flow[FLOWS];
+static long long numflows = 0;
+static struct pollfd p[1 + FLOWS];
+
+/* packets in flight; delay is constant, so a FIFO is in release order */
+#define QUEUE 16384 /* must be power of 2 */
+struct delayed {
+  long long when;
+  int tofd;
+  unsigned char ip[4];
+  unsigned char port[2];
+  long long len;
+  unsigned char x[1184];
+} ;
+static struct delayed *queue;
+static long long queuefirst = 0;
+static long long queuenum = 0;
+
+int relay_init(const unsigned char *ip,const unsigned char *port,
+  const unsigned char *sip,const unsigned char *sport,long long nsec,long long permille)
+{
+  byte_copy(serverip,4,sip);
+  byte_copy(serverport,2,sport);
+  delay = nsec;
+  loss = permille;
+  queue = malloc(QUEUE * sizeof(struct delayed));
+  if (!queue) return -1;
+  clientfd = socket_udp();
+  if (clientfd == -1) return -1;
+  if (socket_bind(clientfd,ip,port) == -1) return -1;
+  return 0;
+}
+
+static long long flow_find(const unsigned char *ip,const unsigned char *port)
+{
+  long long i;
+
+  for (i = 0;i < numflows;++i)
+    if (byte_isequal(flow[i].ip,4,ip) & byte_isequal(flow[i].port,2,port)) return i;
+  if (numflows == FLOWS) return -1;
+  flow[numflows].fd = socket_udp();
+  if (flow[numflows].fd == -1) return -1;
+  byte_copy(flow[numflows].ip,4,ip);
+  byte_copy(flow[numflows].port,2,port);
+  return numflows++;
+}
+
+/* from client if i < 0, otherwise from server to flow i */
+static void receive(long long i)
+{
+  struct delayed *d;
+  unsigned char ip[4];
+  unsigned char port[2];
+  unsigned char packet[4096];
+  long long r;
+  long long f;
+
+  for (;;) {
+    r = socket_recv(i < 0 ? clientfd : flow[i].fd,packet,sizeof packet,ip,port);
+    if (r < 0) return;
+    if (r > sizeof d->x) continue;
+    if (loss) if (randommod(1000) < loss) continue;
+    if (queuenum == QUEUE) continue; /* drop tail */
+    d = &queue[(queuefirst + queuenum) & (QUEUE - 1)];
+    if (i < 0) {
+      f = flow_find(ip,port);
+      if (f < 0) continue;
+      d->tofd = flow[f].fd;
+      byte_copy(d->ip,4,serverip);
+      byte_copy(d->port,2,serverport);
+    } else {
+      d->tofd = clientfd;
+      byte_copy(d->ip,4,flow[i].ip);
+      byte_copy(d->port,2,flow[i].port);
+    }
+    ++queuenum;
+    d->when = nanoseconds() + delay;
+    d->len = r;
+    byte_copy(d->x,r,packet);
+  }
+}
+
+/* releases due packets, then waits at most ms milliseconds (-1: forever) for more */
+void relay_step(long long ms)
+{
+  struct delayed *d;
+  long long timeout;
+  long long recent;
+  long long i;
+  long long n;
+
+  recent = nanoseconds();
+  while (queuenum) {
+    d = &queue[queuefirst & (QUEUE - 1)];
+    if (d->when > recent) break;
+    socket_send(d->tofd,d->x,d->len,d->ip,d->port);
+    ++queuefirst;
+    --queuenum;
+  }
+
+  timeout = ms;
+  if (queuenum) {
+    timeout = (queue[queuefirst & (QUEUE - 1)].when - recent) / 1000000 + 1;
+    if (ms >= 0 && ms < timeout) timeout = ms;
+  }
+  p[0].fd = clientfd; p[0].events = POLLIN;
+  for (i = 0;i < numflows;++i) { p[1 + i].fd = flow[i].fd; p[1 + i].events = POLLIN; }
+  if (poll(p,1 + numflows,timeout) <= 0) return;
+  n = numflows; /* receive() may add flows */
+  if (p[0].revents) receive(-1);
+  for (i = 0;i < n;++i) if (p[1 + i].revents) receive(i);
+}
@@ -0,0 +1,7 @@
+#ifndef RELAY_H
+#define RELAY_H
+
+extern int relay_init(const unsigned char *,const unsigned char *,const unsigned char *,const unsigned char *,long long,long long);
+extern void relay_step(long long);
+
+#endif
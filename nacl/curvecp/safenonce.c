@@ -2,13 +2,13 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <pthread.h>
 #include "crypto_uint64.h"
 #include "uint64_pack.h"
 #include "uint64_unpack.h"
-#include "savesync.h"
-#include "open.h"
 #include "load.h"
 #include "randombytes.h"
+#include "byte.h"
 #include "safenonce.h"
 
 #include "crypto_block.h"
@@ -24,51 +24,200 @@ Output: 128-bit nonce y[0],...,y[15].
 Reads and writes existing 8-byte file ".expertsonly/noncecounter",
 locked via existing 1-byte file ".expertsonly/lock".
 Also reads existing 32-byte file ".expertsonly/noncekey".
-Not thread-safe.
+The files are opened by the first caller, relative to its working directory,
+and stay open; the background thread never resolves a path.
+Thread-safe. After fork, the child reserves its own counters.
 
 Invariants:
-This process is free to use counters that are >=counterlow and <counterhigh.
-The 8-byte file contains a counter that is safe to use and >=counterhigh.
+This process is free to use counters that are >=counterlow and <counterhigh,
+and counters that are >=nextlow and <nexthigh.
+Each thread is free to use counters that are >=threadlow and <threadhigh,
+carved out of the process range.
+The 8-byte file contains a counter that is safe to use and
+>=counterhigh and >=nexthigh.
 
-XXX: should rewrite file in background, rather than briefly pausing
+Only the first range is reserved while the caller waits.
+Once half of a range is used, a background thread reserves the next one,
+so a process issuing nonces steadily never waits for the file.
 */
 
+#define LONGTERMRANGE 1048576
+#define SHORTTERMRANGE 16
+#define THREADRANGE 256
+#define THREADRANDOM 1024 /* random bytes fetched at once, 8 per nonce */
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wantrange = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t haverange = PTHREAD_COND_INITIALIZER;
+static pthread_once_t once = PTHREAD_ONCE_INIT;
+
 static crypto_uint64 counterlow = 0;
 static crypto_uint64 counterhigh = 0;
+static crypto_uint64 countermid = 0; /* start refilling when counterlow reaches this */
+static crypto_uint64 nextlow = 0;
+static crypto_uint64 nexthigh = 0;
+static crypto_uint64 range = 0;
+static int flagrefiller = 0; /* background thread is running */
+static int flagrefill = 0; /* background thread should reserve the next range */
+static int flagrefillfailed = 0;
+
+static __thread crypto_uint64 threadlow = 0;
+static __thread crypto_uint64 threadhigh = 0;
+static __thread unsigned char threadrandom[THREADRANDOM];
+static __thread long long threadrandompos = THREADRANDOM;
 
 static unsigned char flagkeyloaded = 0;
 static unsigned char noncekey[32];
-static unsigned char data[16];
+static int fdlock = -1;
+static int fdcounter = -1;
 
-int safenonce(unsigned char *y,int flaglongterm)
+static int openrw(const char *fn)
 {
-  if (!flagkeyloaded) {
-    int fdlock;
-    fdlock = open_lock(".expertsonly/lock");
+#ifdef O_CLOEXEC
+  return open(fn,O_RDWR | O_CLOEXEC);
+#else
+  int fd = open(fn,O_RDWR);
+  if (fd == -1) return -1;
+  fcntl(fd,F_SETFD,1);
+  return fd;
+#endif
+}
+
+/* caller holds lock */
+static int openfiles(void)
+{
+  if (fdlock == -1) {
+    fdlock = openrw(".expertsonly/lock");
     if (fdlock == -1) return -1;
-    if (load(".expertsonly/noncekey",noncekey,sizeof noncekey) == -1) { close(fdlock); return -1; }
-    close(fdlock);
+  }
+  if (fdcounter == -1) {
+    fdcounter = openrw(".expertsonly/noncecounter");
+    if (fdcounter == -1) return -1;
+  }
+  if (!flagkeyloaded) {
+    if (load(".expertsonly/noncekey",noncekey,sizeof noncekey) == -1) return -1;
     flagkeyloaded = 1;
   }
-  
-  if (counterlow >= counterhigh) {
-    int fdlock;
-    fdlock = open_lock(".expertsonly/lock");
-    if (fdlock == -1) return -1;
-    if (load(".expertsonly/noncecounter",data,8) == -1) { close(fdlock); return -1; }
-    counterlow = uint64_unpack(data);
-    if (flaglongterm)
-      counterhigh = counterlow + 1048576;
-    else
-      counterhigh = counterlow + 1;
-    uint64_pack(data,counterhigh);
-    if (savesync(".expertsonly/noncecounter",data,8) == -1) { close(fdlock); return -1; }
-    close(fdlock);
+  return 0;
+}
+
+static int reserve(crypto_uint64 *low,crypto_uint64 *high,crypto_uint64 len)
+{
+  unsigned char data[8];
+
+  if (lockf(fdlock,F_LOCK,0) == -1) return -1;
+  if (pread(fdcounter,data,8,0) != 8) { lockf(fdlock,F_ULOCK,0); return -1; }
+  *low = uint64_unpack(data);
+  *high = *low + len;
+  uint64_pack(data,*high);
+  if (pwrite(fdcounter,data,8,0) != 8 || fsync(fdcounter) == -1) { lockf(fdlock,F_ULOCK,0); return -1; }
+  lockf(fdlock,F_ULOCK,0);
+  return 0;
+}
+
+static void *refiller(void *arg)
+{
+  crypto_uint64 low;
+  crypto_uint64 high;
+  int r;
+
+  pthread_mutex_lock(&lock);
+  for (;;) {
+    while (!flagrefill) pthread_cond_wait(&wantrange,&lock);
+    pthread_mutex_unlock(&lock);
+    r = reserve(&low,&high,range);
+    pthread_mutex_lock(&lock);
+    flagrefill = 0;
+    if (r == -1)
+      flagrefillfailed = 1;
+    else {
+      nextlow = low;
+      nexthigh = high;
+    }
+    pthread_cond_broadcast(&haverange);
+  }
+  return 0;
+}
+
+static void atfork_prepare(void) { pthread_mutex_lock(&lock); }
+static void atfork_parent(void) { pthread_mutex_unlock(&lock); }
+
+static void atfork_child(void)
+{
+  /* parent keeps using these counters; background thread did not survive */
+  counterlow = counterhigh = countermid = 0;
+  nextlow = nexthigh = 0;
+  threadlow = threadhigh = 0;
+  threadrandompos = THREADRANDOM;
+  flagrefiller = flagrefill = flagrefillfailed = 0;
+  pthread_mutex_unlock(&lock);
+}
+
+static void init(void)
+{
+  pthread_atfork(atfork_prepare,atfork_parent,atfork_child);
+}
+
+static int takerange(void)
+{
+  pthread_t t;
+
+  while (counterlow >= counterhigh) {
+    if (nexthigh > nextlow) {
+      counterlow = nextlow;
+      counterhigh = nexthigh;
+      nextlow = nexthigh = 0;
+    } else if (!flagrefiller) {
+      /* first range: nothing to hand out yet, so wait for the file */
+      if (openfiles() == -1) return -1;
+      if (reserve(&counterlow,&counterhigh,range) == -1) return -1;
+    } else {
+      if (flagrefillfailed) { flagrefillfailed = 0; return -1; }
+      if (!flagrefill) { flagrefill = 1; pthread_cond_signal(&wantrange); }
+      pthread_cond_wait(&haverange,&lock);
+      continue;
+    }
+    countermid = counterlow + (counterhigh - counterlow) / 2;
   }
 
-  randombytes(data + 8,8);
-  uint64_pack(data,counterlow++);
+  if (counterlow >= countermid && nexthigh == nextlow && !flagrefill) {
+    if (!flagrefiller)
+      if (pthread_create(&t,0,refiller,0) == 0) {
+        pthread_detach(t);
+        flagrefiller = 1;
+      }
+    if (flagrefiller) { flagrefill = 1; pthread_cond_signal(&wantrange); }
+  }
+
+  threadlow = counterlow;
+  threadhigh = counterlow + THREADRANGE;
+  if (threadhigh > counterhigh) threadhigh = counterhigh;
+  counterlow = threadhigh;
+  return 0;
+}
+
+int safenonce(unsigned char *y,int flaglongterm)
+{
+  unsigned char data[16];
+
+  if (threadlow >= threadhigh) {
+    pthread_once(&once,init);
+    pthread_mutex_lock(&lock);
+    if (flaglongterm) range = LONGTERMRANGE;
+    else if (!range) range = SHORTTERMRANGE;
+    if (takerange() == -1) { pthread_mutex_unlock(&lock); return -1; }
+    pthread_mutex_unlock(&lock);
+  }
+
+  if (threadrandompos >= THREADRANDOM) {
+    randombytes(threadrandom,THREADRANDOM);
+    threadrandompos = 0;
+  }
+  byte_copy(data + 8,8,threadrandom + threadrandompos);
+  byte_zero(threadrandom + threadrandompos,8);
+  threadrandompos += 8;
+  uint64_pack(data,threadlow++);
   crypto_block(y,data,noncekey);
-  
+
   return 0;
 }
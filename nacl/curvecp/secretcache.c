@@ -0,0 +1,180 @@
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include "crypto_uint64.h"
+#include "uint64_unpack.h"
+#include "byte.h"
+#include "randombytes.h"
+#include "crypto_onetimeauth.h"
+#include "secretcache.h"
+
+#ifndef MAP_ANONYMOUS
+#define MAP_ANONYMOUS MAP_ANON
+#endif
+
+/*
+Cache of crypto_box_beforenm(k,clientlongtermpk,serverlongtermsk),
+shared by all processes forked after secretcache_init.
+
+8-way set-associative; least recently used entry in a set is evicted.
+Evicted and invalidated secrets are wiped.
+
+Optionally backed by a file, which is then locked against other servers;
+the file is discarded if it belongs to a different server key.
+The mapping is locked into memory if the system allows it.
+
+Processes serialize on a robust process-shared mutex in the header.
+A process that dies holding it leaves its set half-written,
+so the next locker wipes every entry before marking the mutex consistent.
+*/
+
+#define WAYS 8
+
+struct secretcache_entry {
+  crypto_uint64 lastuse; /* 0: empty */
+  unsigned char pk[32];
+  unsigned char k[32];
+} ;
+
+struct secretcache_header {
+  unsigned char magic[8];
+  unsigned char serverpk[32];
+  unsigned char hashkey[32];
+  crypto_uint64 numsets;
+  crypto_uint64 clock;
+  pthread_mutex_t lock;
+} ;
+
+static struct secretcache_header *header = 0;
+static struct secretcache_entry *entries;
+static crypto_uint64 setmask;
+
+static int lock(void)
+{
+  int r = pthread_mutex_lock(&header->lock);
+  if (r == EOWNERDEAD) {
+    byte_zero(entries,header->numsets * WAYS * sizeof(struct secretcache_entry));
+    header->clock = 0;
+    if (pthread_mutex_consistent(&header->lock)) r = -1;
+    else r = 0;
+  }
+  return r ? -1 : 0;
+}
+
+static void unlock(void)
+{
+  pthread_mutex_unlock(&header->lock);
+}
+
+static struct secretcache_entry *set(const unsigned char *pk)
+{
+  unsigned char h[16];
+  /* keyed poly1305 of the whole key, so clients cannot aim many keys at one set */
+  crypto_onetimeauth(h,pk,32,header->hashkey);
+  return entries + WAYS * (uint64_unpack(h) & setmask);
+}
+
+int secretcache_init(long long n,const char *fn,const unsigned char *serverpk)
+{
+  crypto_uint64 numsets = 1;
+  long long len;
+  void *x;
+  pthread_mutexattr_t attr;
+  int fd = -1;
+
+  if (n <= 0) return 0;
+  while (numsets * WAYS < n) numsets += numsets;
+  len = sizeof(struct secretcache_header) + numsets * WAYS * sizeof(struct secretcache_entry);
+
+  if (fn) {
+#ifdef O_CLOEXEC
+    fd = open(fn,O_CREAT | O_RDWR | O_CLOEXEC,0600);
+    if (fd == -1) return -1;
+#else
+    fd = open(fn,O_CREAT | O_RDWR,0600);
+    if (fd == -1) return -1;
+    fcntl(fd,F_SETFD,1);
+#endif
+    /* lock is held by this process for its lifetime; fd stays open */
+    if (lockf(fd,F_TLOCK,0) == -1) { close(fd); return -1; }
+    if (ftruncate(fd,len) == -1) { close(fd); return -1; }
+    x = mmap(0,len,PROT_READ | PROT_WRITE,MAP_SHARED,fd,0);
+  } else
+    x = mmap(0,len,PROT_READ | PROT_WRITE,MAP_SHARED | MAP_ANONYMOUS,-1,0);
+  if (x == MAP_FAILED) { if (fd != -1) close(fd); return -1; }
+  mlock(x,len);
+
+  header = x;
+  entries = (struct secretcache_entry *) (header + 1);
+  if (!byte_isequal(header->magic,8,"CurveCPH")
+   || !byte_isequal(header->serverpk,32,serverpk)
+   || header->numsets != numsets) {
+    byte_zero(x,len);
+    byte_copy(header->serverpk,32,serverpk);
+    randombytes(header->hashkey,32);
+    header->numsets = numsets;
+    header->clock = 0;
+    byte_copy(header->magic,8,"CurveCPH");
+  }
+  /* no other process maps the cache yet: the file is lockf-locked by us */
+  if (pthread_mutexattr_init(&attr)) goto fail;
+  if (pthread_mutexattr_setpshared(&attr,PTHREAD_PROCESS_SHARED)
+   || pthread_mutexattr_setrobust(&attr,PTHREAD_MUTEX_ROBUST)
+   || pthread_mutex_init(&header->lock,&attr)) {
+    pthread_mutexattr_destroy(&attr);
+    goto fail;
+  }
+  pthread_mutexattr_destroy(&attr);
+  setmask = numsets - 1;
+  return 0;
+
+  fail:
+  munmap(x,len);
+  if (fd != -1) close(fd);
+  header = 0;
+  return -1;
+}
+
+int secretcache_get(unsigned char *k,const unsigned char *pk)
+{
+  struct secretcache_entry *e;
+  int i;
+  int result = -1;
+
+  if (!header) return -1;
+  e = set(pk);
+  if (lock() == -1) return -1;
+  for (i = 0;i < WAYS;++i)
+    if (e[i].lastuse && byte_isequal(e[i].pk,32,pk)) {
+      e[i].lastuse = ++header->clock;
+      byte_copy(k,32,e[i].k);
+      result = 0;
+      break;
+    }
+  unlock();
+  return result;
+}
+
+void secretcache_put(const unsigned char *pk,const unsigned char *k)
+{
+  struct secretcache_entry *e;
+  int i;
+  int j = 0;
+
+  if (!header) return;
+  e = set(pk);
+  if (lock() == -1) return;
+  for (i = 0;i < WAYS;++i) {
+    if (e[i].lastuse && byte_isequal(e[i].pk,32,pk)) { j = i; break; }
+    if (e[i].lastuse < e[j].lastuse) j = i;
+  }
+  byte_zero(e[j].k,32);
+  byte_copy(e[j].pk,32,pk);
+  byte_copy(e[j].k,32,k);
+  e[j].lastuse = ++header->clock;
+  unlock();
+}
@@ -0,0 +1,8 @@
+#ifndef SECRETCACHE_H
+#define SECRETCACHE_H
+
+extern int secretcache_init(long long,const char *,const unsigned char *);
+extern int secretcache_get(unsigned char *,const unsigned char *);
+extern void secretcache_put(const unsigned char *,const unsigned char *);
+
+#endif
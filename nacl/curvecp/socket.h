@@ -1,9 +1,21 @@
 #ifndef SOCKET_H
 #define SOCKET_H
 
+#define socket_MAXBATCH 64
+
+struct socket_packet {
+  unsigned char *x;
+  long long xlen;
+  unsigned char ip[4];
+  unsigned char port[2];
+} ;
+
 extern int socket_udp(void);
 extern int socket_bind(int,const unsigned char *,const unsigned char *);
+extern int socket_bind_reuse(int,const unsigned char *,const unsigned char *);
 extern int socket_send(int,const unsigned char *,long long,const unsigned char *,const unsigned char *);
 extern long long socket_recv(int,unsigned char *,long long,unsigned char *,unsigned char *);
+extern long long socket_recvbatch(int,struct socket_packet *,long long);
+extern long long socket_sendbatch(int,const struct socket_packet *,long long);
 
 #endif
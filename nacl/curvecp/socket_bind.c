@@ -9,7 +9,21 @@ int socket_bind(int fd,const unsigned char *ip,const unsigned char *port)
 {
   struct sockaddr_in sa;
   byte_zero(&sa,sizeof sa);
+  sa.sin_family = AF_INET;
   byte_copy(&sa.sin_addr,4,ip);
   byte_copy(&sa.sin_port,2,port);
   return bind(fd,(struct sockaddr *) &sa,sizeof sa);
 }
+
+/* several sockets on one port; kernel spreads incoming packets over them */
+int socket_bind_reuse(int fd,const unsigned char *ip,const unsigned char *port)
+{
+#ifdef SO_REUSEPORT
+  const int x = 1;
+  if (setsockopt(fd,SOL_SOCKET,SO_REUSEPORT,&x,sizeof x) == -1) return -1;
+  return socket_bind(fd,ip,port);
+#else
+  errno = EPROTONOSUPPORT;
+  return -1;
+#endif
+}
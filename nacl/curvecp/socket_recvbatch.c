@@ -0,0 +1,60 @@
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <errno.h>
+#include "socket.h"
+#include "byte.h"
+
+/*
+Receives up to n datagrams without blocking.
+On input x[i].xlen is the space at x[i].x; on output it is the packet length.
+Returns number of packets received, or -1 if none.
+*/
+
+long long socket_recvbatch(int fd,struct socket_packet *x,long long n)
+{
+  long long i;
+  long long r;
+
+  if (n < 0) { errno = EPROTO; return -1; }
+  if (n > socket_MAXBATCH) n = socket_MAXBATCH;
+
+#ifdef MSG_WAITFORONE
+  {
+    struct mmsghdr m[socket_MAXBATCH];
+    struct iovec v[socket_MAXBATCH];
+    struct sockaddr_in sa[socket_MAXBATCH];
+
+    for (i = 0;i < n;++i) {
+      if (x[i].xlen < 0) { errno = EPROTO; return -1; }
+      byte_zero(&sa[i],sizeof sa[i]);
+      byte_zero(&m[i],sizeof m[i]);
+      v[i].iov_base = x[i].x;
+      v[i].iov_len = x[i].xlen > 1048576 ? 1048576 : x[i].xlen;
+      m[i].msg_hdr.msg_name = &sa[i];
+      m[i].msg_hdr.msg_namelen = sizeof sa[i];
+      m[i].msg_hdr.msg_iov = &v[i];
+      m[i].msg_hdr.msg_iovlen = 1;
+    }
+    r = recvmmsg(fd,m,n,MSG_DONTWAIT,0);
+    if (r >= 0) {
+      for (i = 0;i < r;++i) {
+        x[i].xlen = m[i].msg_len;
+        byte_copy(x[i].ip,4,&sa[i].sin_addr);
+        byte_copy(x[i].port,2,&sa[i].sin_port);
+      }
+      return r;
+    }
+    if (errno != ENOSYS) return -1;
+  }
+#endif
+
+  for (i = 0;i < n;++i) {
+    r = socket_recv(fd,x[i].x,x[i].xlen,x[i].ip,x[i].port);
+    if (r < 0) break;
+    x[i].xlen = r;
+  }
+  if (i == 0) return -1;
+  return i;
+}
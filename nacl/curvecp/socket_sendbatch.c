@@ -0,0 +1,63 @@
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <errno.h>
+#include "socket.h"
+#include "byte.h"
+
+/*
+Sends n datagrams, as few system calls as possible.
+Like socket_send, a packet that cannot be sent is dropped.
+Returns number of packets sent.
+*/
+
+long long socket_sendbatch(int fd,const struct socket_packet *x,long long n)
+{
+  long long sent = 0;
+  long long pos;
+  long long num;
+  long long i;
+  long long r;
+
+  for (pos = 0;pos < n;pos += num) {
+    num = n - pos;
+    if (num > socket_MAXBATCH) num = socket_MAXBATCH;
+
+#ifdef MSG_WAITFORONE
+    {
+      struct mmsghdr m[socket_MAXBATCH];
+      struct iovec v[socket_MAXBATCH];
+      struct sockaddr_in sa[socket_MAXBATCH];
+      long long done = 0;
+
+      for (i = 0;i < num;++i) {
+        byte_zero(&sa[i],sizeof sa[i]);
+        sa[i].sin_family = AF_INET;
+        byte_copy(&sa[i].sin_addr,4,x[pos + i].ip);
+        byte_copy(&sa[i].sin_port,2,x[pos + i].port);
+        byte_zero(&m[i],sizeof m[i]);
+        v[i].iov_base = (void *) x[pos + i].x;
+        v[i].iov_len = x[pos + i].xlen;
+        m[i].msg_hdr.msg_name = &sa[i];
+        m[i].msg_hdr.msg_namelen = sizeof sa[i];
+        m[i].msg_hdr.msg_iov = &v[i];
+        m[i].msg_hdr.msg_iovlen = 1;
+      }
+      while (done < num) {
+        r = sendmmsg(fd,m + done,num - done,0);
+        if (r > 0) { done += r; sent += r; continue; }
+        if (r == -1 && errno == EINTR) continue;
+        if (r == -1 && errno == ENOSYS) break;
+        ++done; /* drop the packet that failed */
+      }
+      if (done == num) continue;
+    }
+#endif
+
+    for (i = 0;i < num;++i)
+      if (socket_send(fd,x[pos + i].x,x[pos + i].xlen,x[pos + i].ip,x[pos + i].port) >= 0)
+        ++sent;
+  }
+  return sent;
+}
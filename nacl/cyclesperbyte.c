@@ -0,0 +1,267 @@
+/*
+ * cyclesperbyte.c
+ * Cycle counts for the primitives linked into the node addon,
+ * over message lengths from 0 bytes to 16 megabytes.
+ * Prints one JSON object to stdout.
+ *
+ * Usage: cyclesperbyte [-m maxbytes] [operation ...]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "cpucycles.h"
+#include "randombytes.h"
+#include "crypto_box.h"
+#include "crypto_secretbox.h"
+#include "crypto_onetimeauth.h"
+#include "crypto_stream.h"
+#include "crypto_hash.h"
+#include "crypto_sign.h"
+#include "crypto_scalarmult.h"
+
+#define MAXBYTES 16777216
+#define MAXSAMPLES 63
+#define PAD 64 /* room for zero padding, authenticators, signatures */
+
+static unsigned char *m;
+static unsigned char *c;
+static unsigned char *t;
+
+static unsigned char boxpk[crypto_box_PUBLICKEYBYTES];
+static unsigned char boxsk[crypto_box_SECRETKEYBYTES];
+static unsigned char boxk[crypto_box_BEFORENMBYTES];
+static unsigned char signpk[crypto_sign_PUBLICKEYBYTES];
+static unsigned char signsk[crypto_sign_SECRETKEYBYTES];
+static unsigned char key[32];
+static unsigned char nonce[crypto_box_NONCEBYTES];
+static unsigned char q[crypto_scalarmult_BYTES];
+static unsigned long long smlen;
+
+static void fail(const char *why)
+{
+  fprintf(stderr,"cyclesperbyte: fatal: %s\n",why);
+  exit(111);
+}
+
+static unsigned char *alignedcalloc(unsigned long long len)
+{
+  unsigned char *x = (unsigned char *) calloc(1,len + 128);
+  if (!x) fail("out of memory");
+  /* will never deallocate so shifting is ok */
+  x += 63 & (-(unsigned long) x);
+  return x;
+}
+
+/* each operation sets up its input once, then runs on len bytes */
+
+static void box_setup(long long len) { }
+static void box(long long len)
+{
+  crypto_box(c,m,len + crypto_box_ZEROBYTES,nonce,boxpk,boxsk);
+}
+
+static void box_open_setup(long long len)
+{
+  crypto_box(c,m,len + crypto_box_ZEROBYTES,nonce,boxpk,boxsk);
+}
+static void box_open(long long len)
+{
+  if (crypto_box_open(t,c,len + crypto_box_ZEROBYTES,nonce,boxpk,boxsk) != 0)
+    fail("crypto_box_open rejected its input");
+}
+
+static void beforenm(long long len)
+{
+  crypto_box_beforenm(boxk,boxpk,boxsk);
+}
+
+static void afternm_setup(long long len)
+{
+  crypto_box_beforenm(boxk,boxpk,boxsk);
+}
+static void afternm(long long len)
+{
+  crypto_box_afternm(c,m,len + crypto_box_ZEROBYTES,nonce,boxk);
+}
+
+static void secretbox(long long len)
+{
+  crypto_secretbox(c,m,len + crypto_secretbox_ZEROBYTES,nonce,key);
+}
+
+static void secretbox_open_setup(long long len)
+{
+  crypto_secretbox(c,m,len + crypto_secretbox_ZEROBYTES,nonce,key);
+}
+static void secretbox_open(long long len)
+{
+  if (crypto_secretbox_open(t,c,len + crypto_secretbox_ZEROBYTES,nonce,key) != 0)
+    fail("crypto_secretbox_open rejected its input");
+}
+
+static void onetimeauth(long long len)
+{
+  crypto_onetimeauth(c,m,len,key);
+}
+
+static void stream(long long len)
+{
+  crypto_stream_xor(c,m,len,nonce,key);
+}
+
+static void hash(long long len)
+{
+  crypto_hash(c,m,len);
+}
+
+static void sign(long long len)
+{
+  crypto_sign(c,&smlen,m,len,signsk);
+}
+
+static void sign_open_setup(long long len)
+{
+  crypto_sign(c,&smlen,m,len,signsk);
+}
+static void sign_open(long long len)
+{
+  unsigned long long tlen;
+  if (crypto_sign_open(t,&tlen,c,smlen,signpk) != 0)
+    fail("crypto_sign_open rejected its input");
+}
+
+static void scalarmult(long long len)
+{
+  crypto_scalarmult(q,boxsk,boxpk);
+}
+
+static struct operation {
+  const char *name;
+  void (*setup)(long long);
+  void (*run)(long long);
+  int flagbytes; /* 0: fixed-size input, measured once */
+} operation[] = {
+  { "box", box_setup, box, 1 }
+, { "box_open", box_open_setup, box_open, 1 }
+, { "beforenm", box_setup, beforenm, 0 }
+, { "afternm", afternm_setup, afternm, 1 }
+, { "secretbox", box_setup, secretbox, 1 }
+, { "secretbox_open", secretbox_open_setup, secretbox_open, 1 }
+, { "onetimeauth", box_setup, onetimeauth, 1 }
+, { "stream", box_setup, stream, 1 }
+, { "hash", box_setup, hash, 1 }
+, { "sign", box_setup, sign, 1 }
+, { "sign_open", sign_open_setup, sign_open, 1 }
+, { "scalarmult", box_setup, scalarmult, 0 }
+, { 0, 0, 0, 0 }
+} ;
+
+static long long sizes[] = {
+  0, 1, 16, 64, 256, 1024, 4096, 16384, 65536,
+  262144, 1048576, 4194304, 16777216, -1
+} ;
+
+static int cmp(const void *x,const void *y)
+{
+  long long a = *(const long long *) x;
+  long long b = *(const long long *) y;
+  return a < b ? -1 : a > b;
+}
+
+/* fewer samples for long messages; their medians settle quickly */
+static long long samples(long long len)
+{
+  if (len <= 65536) return MAXSAMPLES;
+  if (len <= 1048576) return 15;
+  return 5;
+}
+
+static int flagfirst = 1;
+
+static void printquartiles(const char *name,long long *x,long long n,long long len)
+{
+  long long q1 = x[n / 4];
+  long long q2 = x[n / 2];
+  long long q3 = x[(3 * n) / 4];
+
+  printf(",\"%s\":{\"q1\":%lld,\"median\":%lld,\"q3\":%lld}",name,q1,q2,q3);
+  if (len > 0)
+    printf(",\"%sperbyte\":{\"q1\":%.3f,\"median\":%.3f,\"q3\":%.3f}",name
+      ,(double) q1 / len,(double) q2 / len,(double) q3 / len);
+}
+
+static void measure(struct operation *o,long long len)
+{
+  long long x[MAXSAMPLES];
+  long long n = samples(len);
+  long long i;
+  long long before;
+
+  o->setup(len);
+  o->run(len); /* warm caches */
+  for (i = 0;i < n;++i) {
+    before = cpucycles();
+    o->run(len);
+    x[i] = cpucycles() - before;
+  }
+  qsort(x,n,sizeof x[0],cmp);
+
+  printf("%s\n  {\"operation\":\"%s\"",flagfirst ? "" : ",",o->name);
+  if (o->flagbytes) printf(",\"bytes\":%lld",len);
+  printf(",\"samples\":%lld",n);
+  printquartiles("cycles",x,n,o->flagbytes ? len : 0);
+  printf("}");
+  fflush(stdout);
+  flagfirst = 0;
+}
+
+static int wanted(struct operation *o,char **names)
+{
+  if (!*names) return 1;
+  for (;*names;++names) if (!strcmp(*names,o->name)) return 1;
+  return 0;
+}
+
+int main(int argc,char **argv)
+{
+  long long maxbytes = MAXBYTES;
+  struct operation *o;
+  char **names;
+  long long i;
+
+  names = argv + 1;
+  if (*names && !strcmp(*names,"-m")) {
+    if (!names[1]) fail("-m needs a byte count");
+    maxbytes = atoll(names[1]);
+    if (maxbytes < 0 || maxbytes > MAXBYTES) fail("maxbytes must be between 0 and 16777216");
+    names += 2;
+  }
+  for (i = 0;names[i];++i) {
+    for (o = operation;o->name;++o) if (!strcmp(names[i],o->name)) break;
+    if (!o->name) fail("unknown operation");
+  }
+
+  m = alignedcalloc(maxbytes + PAD);
+  c = alignedcalloc(maxbytes + PAD);
+  t = alignedcalloc(maxbytes + PAD);
+  randombytes(m + PAD,maxbytes);
+  randombytes(key,sizeof key);
+  randombytes(nonce,sizeof nonce);
+  crypto_box_keypair(boxpk,boxsk);
+  crypto_sign_keypair(signpk,signsk);
+
+  /* box and secretbox want ZEROBYTES of zeros in front of the message */
+  m += PAD - crypto_box_ZEROBYTES;
+
+  printf("{\"cpucycles_implementation\":\"%s\"",cpucycles_implementation);
+  printf(",\"cpucycles_persecond\":%lld",cpucycles_persecond());
+  printf(",\"results\":[");
+  for (o = operation;o->name;++o) {
+    if (!wanted(o,names)) continue;
+    if (!o->flagbytes) { measure(o,0); continue; }
+    for (i = 0;sizes[i] >= 0 && sizes[i] <= maxbytes;++i) measure(o,sizes[i]);
+  }
+  printf("\n]}\n");
+  return 0;
+}
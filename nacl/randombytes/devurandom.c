@@ -7,22 +7,30 @@
 
 static int fd = -1;
 
-void randombytes(unsigned char *x,unsigned long long xlen)
+/* threads may race to open; the first to publish its fd wins */
+static int urandomfd(void)
 {
-  int i;
+  int f;
 
-  if (fd == -1) {
-    for (;;) {
-      fd = open("/dev/urandom",O_RDONLY);
-      if (fd != -1) break;
-      sleep(1);
-    }
+  if (fd != -1) return fd;
+  for (;;) {
+    f = open("/dev/urandom",O_RDONLY);
+    if (f != -1) break;
+    sleep(1);
   }
+  if (!__sync_bool_compare_and_swap(&fd,-1,f)) close(f);
+  return fd;
+}
+
+void randombytes(unsigned char *x,unsigned long long xlen)
+{
+  int i;
+  int f = urandomfd();
 
   while (xlen > 0) {
     if (xlen < 1048576) i = xlen; else i = 1048576;
 
-    i = read(fd,x,i);
+    i = read(f,x,i);
     if (i < 1) {
       sleep(1);
       continue;
@@ -46,6 +46,102 @@ describe("nacl", function() {
         });
     });
 
+    describe("#inflate_box_open", function() {
+        var n = new Buffer(nacl.box_NONCEBYTES);
+        var kp_send = nacl.box_keypair();
+        var kp_recv = nacl.box_keypair();
+
+        var m = new Buffer(100000);
+        m.fill(0x61);
+        var c = nacl.deflate_box_sync(m, n, kp_recv[0], kp_send[1]);
+
+        it("correctness", function(done) {
+            nacl.inflate_box_open(c, n, kp_send[0], kp_recv[1], function(err, m2) {
+                assert.equal(err, null);
+                assert(buffer_equal(m, m2));
+                done();
+            });
+        });
+
+        it("maxlen", function(done) {
+            var m2 = nacl.inflate_box_open_sync(c, n, kp_send[0], kp_recv[1], m.length);
+            assert(buffer_equal(m, m2));
+
+            nacl.inflate_box_open(c, n, kp_send[0], kp_recv[1], m.length - 1, function(err, m2) {
+                assert.notEqual(err, null);
+                assert.equal(m2, null);
+                done();
+            });
+        });
+
+        it("stream", function(done) {
+            var chunks = [];
+            var ondata = function(chunk) {
+                chunks.push(chunk);
+            };
+            nacl.inflate_box_open_stream(c, n, kp_send[0], kp_recv[1], ondata, function(err) {
+                assert.equal(err, null);
+                assert(chunks.length > 1);
+                assert(buffer_equal(m, Buffer.concat(chunks)));
+                done();
+            });
+        });
+
+        it("stream queue stays bounded behind a slow ondata", function(done) {
+            this.timeout(10000);
+            var big = new Buffer(4 * 1024 * 1024);
+            big.fill(0x62);
+            var big_c = nacl.deflate_box_sync(big, n, kp_recv[0], kp_send[1]);
+            var received = 0, deepest = 0;
+            var ondata = function(chunk, queued) {
+                var until = Date.now() + 1;
+                while(Date.now() < until);
+                received += chunk.length;
+                deepest = Math.max(deepest, queued);
+            };
+            nacl.inflate_box_open_stream(big_c, n, kp_send[0], kp_recv[1], ondata, function(err) {
+                assert.equal(err, null);
+                assert.equal(received, big.length);
+                assert(deepest <= nacl.stream_MAXCHUNKS);
+                done();
+            });
+        });
+
+        it("stream stops when ondata throws", function(done) {
+            var listeners = process.listeners("uncaughtException");
+            process.removeAllListeners("uncaughtException");
+            var thrown = null, calls = 0;
+            process.once("uncaughtException", function(e) {
+                thrown = e;
+            });
+            var ondata = function() {
+                calls++;
+                throw new Error("stop");
+            };
+            nacl.inflate_box_open_stream(c, n, kp_send[0], kp_recv[1], ondata, function(err) {
+                listeners.forEach(function(l) {
+                    process.on("uncaughtException", l);
+                });
+                assert.equal(err, "stream aborted");
+                assert.equal(thrown.message, "stop");
+                assert.equal(calls, 1);
+                done();
+            });
+        });
+
+        it("stream maxlen", function(done) {
+            var received = 0;
+            var ondata = function(chunk) {
+                received += chunk.length;
+            };
+            nacl.inflate_box_open_stream(c, n, kp_send[0], kp_recv[1], 1000, ondata, function(err) {
+                assert.notEqual(err, null);
+                assert(received <= 1000);
+                done();
+            });
+        });
+    });
+
     describe("#sign", function() {
         it("key-pair length", function() {
             var kp = nacl.sign_keypair();
@@ -67,6 +163,18 @@ describe("nacl", function() {
                 });
             });
         });
+
+        it("messages longer than 32 bytes", function() {
+            var kp = nacl.sign_keypair();
+            var m = new Buffer(1000);
+            for(var i = 0; i < m.length; i++) {
+                m[i] = i & 0xff;
+            }
+
+            var sm = nacl.sign_sync(m, kp[1]);
+            assert.equal(sm.length, m.length + 64);
+            assert(buffer_equal(nacl.sign_open_sync(sm, kp[0]), m));
+        });
     });
 
     describe("#secretbox", function() {
@@ -87,4 +195,325 @@ describe("nacl", function() {
             });
         });
     });
+
+    describe("#keys", function() {
+        var n = new Buffer(nacl.box_NONCEBYTES);
+        var m = new Buffer(100);
+        m.fill(3);
+
+        it("box with a BoxKey matches raw keys", function(done) {
+            var kp_send = nacl.box_keypair();
+            var kp_recv = nacl.box_keypair();
+            var key = new nacl.BoxKey(kp_recv[0], kp_send[1]);
+
+            nacl.box(m, n, key, function(err, c) {
+                assert.equal(err, null);
+                assert(buffer_equal(c, nacl.box_sync(m, n, kp_recv[0], kp_send[1])));
+                var open_key = new nacl.BoxKey(kp_send[0], kp_recv[1]);
+                assert(buffer_equal(nacl.box_open_sync(c, n, open_key), m));
+                done();
+            });
+        });
+
+        it("signs and verifies with SignKey and VerifyKey", function(done) {
+            var kp = nacl.sign_keypair();
+            var sign_key = new nacl.SignKey(kp[1]);
+            var verify_key = new nacl.VerifyKey(kp[0]);
+
+            nacl.sign(m, sign_key, function(err, sm) {
+                assert.equal(err, null);
+                assert(buffer_equal(sm, nacl.sign_sync(m, kp[1])));
+                nacl.sign_open(sm, verify_key, function(err, m2) {
+                    assert.equal(err, null);
+                    assert(buffer_equal(m2, m));
+                    done();
+                });
+            });
+        });
+
+        it("secretbox with a SecretKey matches a raw key", function() {
+            var k = new Buffer(nacl.secretbox_KEYBYTES);
+            k.fill(1);
+            var key = new nacl.SecretKey(k);
+            var c = nacl.secretbox_sync(m, n, key);
+            assert(buffer_equal(c, nacl.secretbox_sync(m, n, k)));
+            assert(buffer_equal(nacl.secretbox_open_sync(c, n, key), m));
+        });
+
+        it("rejects wrong lengths and use after destroy", function(done) {
+            assert.throws(function() {
+                new nacl.SecretKey(new Buffer(5));
+            }, /incorrect key length/);
+
+            var key = new nacl.SecretKey(new Buffer(nacl.secretbox_KEYBYTES));
+            key.destroy();
+            nacl.secretbox(m, n, key, function(err, c) {
+                assert.equal(err, "key destroyed");
+                assert.equal(c, null);
+                done();
+            });
+        });
+    });
+
+    describe("#stats", function() {
+        it("counts ops, bytes and failures", function(done) {
+            var n = new Buffer(nacl.secretbox_NONCEBYTES);
+            var k = new Buffer(nacl.secretbox_KEYBYTES);
+            var m = new Buffer(100);
+
+            nacl.stats_reset();
+            var c = nacl.secretbox_sync(m, n, k);
+            c[c.length - 1] ^= 1;
+            nacl.secretbox_open(c, n, k, function(err) {
+                assert.notEqual(err, null);
+
+                var s = nacl.stats();
+                assert.equal(s.types.secretbox.ops, 1);
+                assert.equal(s.types.secretbox.bytes_in, m.length);
+                assert.equal(s.types.secretbox.bytes_out, c.length);
+                assert.equal(s.types.secretbox.exec.count, 1);
+                assert.equal(s.types.secretbox.queue_wait.count, 0);
+
+                assert.equal(s.types.secretbox_open.ops, 1);
+                assert.equal(s.types.secretbox_open.failures[err], 1);
+                assert.equal(s.types.secretbox_open.inline_ops, 1);
+                assert.equal(s.types.secretbox_open.queue_wait.count, 0);
+                assert.equal(s.queue_depth, 0);
+
+                nacl.stats_reset();
+                assert.equal(nacl.stats().types.secretbox.ops, 0);
+                done();
+            });
+        });
+    });
+
+    describe("#inline", function() {
+        var n = new Buffer(nacl.secretbox_NONCEBYTES);
+        var k = new Buffer(nacl.secretbox_KEYBYTES);
+        var m = new Buffer(100);
+
+        afterEach(function() {
+            nacl.set_inline_threshold(10000);
+        });
+
+        it("runs small requests inline with a deferred callback", function(done) {
+            nacl.stats_reset();
+            var returned = false;
+            nacl.secretbox(m, n, k, function(err, c) {
+                assert.equal(err, null);
+                assert(returned);
+                assert(buffer_equal(c, nacl.secretbox_sync(m, n, k)));
+                assert.equal(nacl.stats().types.secretbox.inline_ops, 1);
+                done();
+            });
+            returned = true;
+        });
+
+        it("costs keyed requests apart from raw-key ones", function(done) {
+            var bn = new Buffer(nacl.box_NONCEBYTES);
+            var kp_send = nacl.box_keypair();
+            var kp_recv = nacl.box_keypair();
+            var key = new nacl.BoxKey(kp_recv[0], kp_send[1]);
+
+            // Cheap BoxKey runs must not pull raw-key boxes under the threshold
+            for(var i = 0; i < 50; i++) {
+                nacl.box_sync(m, bn, key);
+            }
+            nacl.stats_reset();
+            nacl.box(m, bn, key, function(err) {
+                assert.equal(err, null);
+                assert.equal(nacl.stats().types.box.inline_ops, 1);
+                nacl.box(m, bn, kp_recv[0], kp_send[1], function(err) {
+                    assert.equal(err, null);
+                    var s = nacl.stats().types.box;
+                    assert.equal(s.inline_ops, 1);
+                    assert.equal(s.queue_wait.count, 1);
+                    done();
+                });
+            });
+        });
+
+        it("threshold 0 sends everything to the threadpool", function(done) {
+            nacl.set_inline_threshold(0);
+            nacl.stats_reset();
+            nacl.secretbox(m, n, k, function(err, c) {
+                assert.equal(err, null);
+                var s = nacl.stats().types.secretbox;
+                assert.equal(s.inline_ops, 0);
+                assert.equal(s.queue_wait.count, 1);
+                done();
+            });
+        });
+    });
+
+    describe("#coalesce", function() {
+        var n = new Buffer(nacl.secretbox_NONCEBYTES);
+        var m = new Buffer(65536);
+        m.fill(0x61);
+
+        var open_all = function(count, done) {
+            var keys = [], boxes = [], pending = count;
+            for(var i = 0; i < count; i++) {
+                keys.push(new Buffer(nacl.secretbox_KEYBYTES));
+                keys[i].fill(i);
+                boxes.push(nacl.secretbox_sync(m, n, keys[i]));
+            }
+            // One forged box must not affect the others in its batch
+            boxes[1][20] ^= 1;
+            boxes.forEach(function(c, i) {
+                nacl.secretbox_open(c, n, keys[i], function(err, m2) {
+                    if(i == 1) {
+                        assert.notEqual(err, null);
+                    } else {
+                        assert.equal(err, null);
+                        assert(buffer_equal(m, m2));
+                    }
+                    if(--pending == 0) done();
+                });
+            });
+        };
+
+        after(function() {
+            nacl.set_coalesce(true);
+        });
+
+        it("opens a burst of boxes in batches", function(done) {
+            open_all(9, done);
+        });
+
+        it("works with coalescing off", function(done) {
+            nacl.set_coalesce(false);
+            open_all(9, done);
+        });
+    });
+
+    describe("#schedule", function() {
+        var n = new Buffer(nacl.box_NONCEBYTES);
+        var kp_send = nacl.box_keypair();
+        var kp_recv = nacl.box_keypair();
+        var m = new Buffer(100);
+
+        it("fails requests whose deadline passed", function(done) {
+            nacl.box(m, n, kp_recv[0], kp_send[1], { deadline: 0 }, function(err, c) {
+                assert.equal(err, "deadline exceeded");
+                assert.equal(c, null);
+                done();
+            });
+        });
+
+        it("serves interactive requests before bulk ones", function(done) {
+            var kp = nacl.sign_keypair(), order = [];
+            // Through the lanes, not inline; all nine enter them together
+            nacl.set_inline_threshold(0);
+            nacl.set_coalesce(true);
+            var finish = function(name) {
+                return function(err) {
+                    assert.equal(err, null);
+                    order.push(name);
+                    if(order.length < 9) return;
+                    nacl.set_inline_threshold(10000);
+                    // Only bulk requests taken by other runners at the
+                    // same moment can finish first
+                    assert(order.indexOf("interactive") < 4);
+                    done();
+                };
+            };
+            for(var i = 0; i < 8; i++) {
+                nacl.sign(m, kp[1], { priority: "bulk" }, finish("bulk"));
+            }
+            nacl.sign(m, kp[1], { priority: "interactive", deadline: 10000 },
+                finish("interactive"));
+        });
+    });
+
+    describe("#limits", function() {
+        afterEach(function() {
+            nacl.set_limits(0, 0);
+        });
+
+        it("turns requests away as busy and calls ondrain", function(done) {
+            var kp = nacl.sign_keypair(), m = new Buffer(100), left = 3;
+            var finish = function() {
+                if(--left == 0) done();
+            };
+            nacl.set_limits(1, 0, finish);
+            assert.equal(nacl.sign(m, kp[1], function(err) {
+                assert.equal(err, null);
+                finish();
+            }), true);
+            assert.equal(nacl.sign(m, kp[1], function(err, sm) {
+                assert.equal(err, "busy");
+                assert.equal(sm, null);
+                finish();
+            }), false);
+        });
+    });
+
+    describe("#instances", function() {
+        var path = require.resolve("../build/Release/nacl");
+        delete require.cache[path];
+        // Loading again runs init() again, on a fresh exports object
+        var nacl2 = require(path);
+
+        after(function() {
+            nacl2.set_limits(0, 0);
+        });
+
+        it("keeps limits, counters and callbacks per instance", function(done) {
+            var kp = nacl.sign_keypair(), m = new Buffer(100), left = 3;
+            var finish = function(expect) {
+                return function(err) {
+                    assert.equal(err, expect);
+                    if(--left == 0) done();
+                };
+            };
+            assert.notStrictEqual(nacl2, nacl);
+            nacl2.set_limits(1, 0);
+
+            assert.equal(nacl2.sign(m, kp[1], finish(null)), true);
+            assert.equal(nacl2.stats().in_flight_requests, 1);
+            assert.equal(nacl.stats().in_flight_requests, 0);
+
+            // The other instance's limit does not apply here
+            assert.equal(nacl.sign(m, kp[1], finish(null)), true);
+            assert.equal(nacl.stats().in_flight_requests, 1);
+            assert.equal(nacl2.sign(m, kp[1], finish("busy")), false);
+        });
+
+        it("has its own key classes", function() {
+            var k = new Buffer(nacl.secretbox_KEYBYTES), n = new Buffer(nacl.secretbox_NONCEBYTES);
+            k.fill(2);
+            var key = new nacl2.SecretKey(k);
+            assert(key instanceof nacl2.SecretKey);
+            assert(!(key instanceof nacl.SecretKey));
+            var c = nacl2.secretbox_sync(new Buffer("hi"), n, key);
+            assert(buffer_equal(c, nacl.secretbox_sync(new Buffer("hi"), n, k)));
+        });
+    });
+
+    describe("#trace", function() {
+        it("exports request stages as trace events", function(done) {
+            var n = new Buffer(nacl.box_NONCEBYTES);
+            var kp_send = nacl.box_keypair();
+            var kp_recv = nacl.box_keypair();
+
+            nacl.trace_start(1024, 1);
+            nacl.box(new Buffer(100), n, kp_recv[0], kp_send[1], function(err) {
+                assert.equal(err, null);
+                setImmediate(function() {
+                    nacl.trace_stop();
+                    var events = JSON.parse(nacl.trace_export()).traceEvents;
+                    var stages = events.map(function(e) {
+                        assert.equal(e.cat, "box");
+                        assert.equal(e.ph, "X");
+                        assert(e.dur >= 0);
+                        return e.name;
+                    });
+                    assert.deepEqual(stages,
+                        ["queue", "beforenm", "afternm", "deliver", "callback"]);
+                    done();
+                });
+            });
+        });
+    });
 });